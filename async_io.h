@@ -0,0 +1,523 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#endif
+
+/*
+    Whole-file reads and writes which keep several requests in flight, so the
+    encode and decode loops only wait when the data they need is not there yet.
+    All methods may be called from any thread.
+*/
+class AsyncIO {
+public:
+    virtual ~AsyncIO() {}
+
+    // start reading a whole file, returns a ticket for waitRead
+    virtual int submitRead(const std::string& filename) = 0;
+
+    // wait for a read, false if the file could not be read
+    virtual bool waitRead(int ticket, std::vector<unsigned char>& data) = 0;
+
+    // queue a write of the whole buffer, the data is taken over
+    virtual void submitWrite(const std::string& filename, std::vector<unsigned char>& data) = 0;
+
+    // wait until every queued write has finished
+    virtual void flush() = 0;
+
+    virtual const char* name() const = 0;
+};
+
+inline bool readWholeFile(const std::string& filename, std::vector<unsigned char>& data) {
+    std::ifstream ifs(filename.c_str(), std::ifstream::in | std::ifstream::binary);
+    if (!ifs) return false;
+    data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return true;
+}
+
+inline bool writeWholeFile(const std::string& filename, const std::vector<unsigned char>& data) {
+    std::ofstream ofs(filename.c_str(), std::ofstream::out | std::ofstream::binary);
+    if (!ofs) return false;
+    if (!data.empty()) ofs.write((const char*)&data[0], data.size());
+    return ofs.good();
+}
+
+/*** portable backend, blocking file calls on a few worker threads ***/
+class ThreadPoolIO : public AsyncIO {
+public:
+    explicit ThreadPoolIO(int threads) : next_ticket(0), pending_writes(0), stop(false) {
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&ThreadPoolIO::work, this));
+    }
+
+    ~ThreadPoolIO() {
+        flush();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        task_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    int submitRead(const std::string& filename) {
+        std::unique_lock<std::mutex> lock(mutex);
+        int ticket = next_ticket++;
+        reads[ticket].done = false;
+        tasks.push_back([this, ticket, filename]() {
+            std::vector<unsigned char> data;
+            bool ok = readWholeFile(filename, data);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            ReadResult& result = reads[ticket];
+            result.done = true;
+            result.ok = ok;
+            result.data.swap(data);
+            done_cv.notify_all();
+        });
+        task_cv.notify_one();
+        return ticket;
+    }
+
+    bool waitRead(int ticket, std::vector<unsigned char>& data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (reads.find(ticket) == reads.end()) return false;
+        done_cv.wait(lock, [&]() { return reads[ticket].done; });
+
+        ReadResult& result = reads[ticket];
+        bool ok = result.ok;
+        data.swap(result.data);
+        reads.erase(ticket);
+        return ok;
+    }
+
+    void submitWrite(const std::string& filename, std::vector<unsigned char>& data) {
+        std::shared_ptr<std::vector<unsigned char> > buffer(new std::vector<unsigned char>());
+        buffer->swap(data);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_writes++;
+        tasks.push_back([this, filename, buffer]() {
+            if (!writeWholeFile(filename, *buffer))
+                std::cerr << "Can not write " << filename << "." << std::endl;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            pending_writes--;
+            done_cv.notify_all();
+        });
+        task_cv.notify_one();
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&]() { return pending_writes == 0; });
+    }
+
+    const char* name() const { return "threads"; }
+
+private:
+    struct ReadResult {
+        bool done;
+        bool ok;
+        std::vector<unsigned char> data;
+    };
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_cv.wait(lock, [&]() { return stop || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable task_cv, done_cv;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> workers;
+    std::map<int, ReadResult> reads;
+    int next_ticket;
+    int pending_writes;
+    bool stop;
+};
+
+#ifdef HAVE_IO_URING
+/*
+    Linux io_uring backend. Every request is a small state machine of
+    open, fixed-buffer read/write chunks and close, all submitted to the ring,
+    so the calling thread never makes a blocking file syscall. Each request
+    owns one registered buffer slot while in flight, which also bounds the
+    number of requests in flight.
+    Only the completion thread sleeps in the ring, and it does so without the
+    lock: it takes the lock to move the finished requests on and wakes their
+    waiters, so a submit never waits for the storage behind another thread.
+*/
+class IOUringIO : public AsyncIO {
+public:
+    // size of one registered buffer, larger files take several chunks
+    static const size_t SLOT_SIZE = 1 << 20;
+
+    explicit IOUringIO(int depth) : ring_fd(-1), sq_ptr(NULL), cq_ptr(NULL), sqes(NULL),
+                                    sq_size(0), cq_size(0), sqes_size(0), to_submit(0),
+                                    next_ticket(0), pending_writes(0), stop(false) {
+        unsigned entries = 1;
+        while (entries < (unsigned)depth) entries *= 2;
+
+        // create the ring
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) return;
+
+        // map submission queue, completion queue and submission entries
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = (unsigned char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) { sq_ptr = NULL; release(); return; }
+        if (single_mmap) cq_ptr = sq_ptr;
+        else {
+            cq_ptr = (unsigned char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) { cq_ptr = NULL; release(); return; }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) { sqes = NULL; release(); return; }
+
+        sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+        sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+        cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+        cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+        // every operation we use must be supported by the kernel
+        std::vector<unsigned char> probe_data(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = (io_uring_probe*)&probe_data[0];
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) { release(); return; }
+        const int ops[] = {IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE};
+        for (int i = 0; i < 5; i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) { release(); return; }
+        }
+
+        // register one buffer slot per request in flight
+        buffers.resize(depth * SLOT_SIZE);
+        std::vector<iovec> iovecs(depth);
+        for (int i = 0; i < depth; i++) {
+            iovecs[i].iov_base = &buffers[i * SLOT_SIZE];
+            iovecs[i].iov_len = SLOT_SIZE;
+            free_slots.push_back(i);
+        }
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iovecs[0], depth) < 0) { release(); return; }
+
+        completion_thread = std::thread(&IOUringIO::complete, this);
+    }
+
+    ~IOUringIO() {
+        if (ring_fd < 0) return;
+
+        // the kernel may still use the buffers of unfinished requests
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [&]() { return free_slots.size() * SLOT_SIZE == buffers.size(); });
+
+            // a no-op completion wakes the completion thread up to see the stop
+            stop = true;
+            io_uring_sqe* sqe = nextEntry();
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = STOP_TICKET;
+            push();
+        }
+        completion_thread.join();
+        for (std::map<int, Request*>::iterator it = requests.begin(); it != requests.end(); ++it)
+            delete it->second;
+        release();
+    }
+
+    bool valid() const { return ring_fd >= 0; }
+
+    int submitRead(const std::string& filename) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return start(lock, filename, false, NULL);
+    }
+
+    bool waitRead(int ticket, std::vector<unsigned char>& data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (requests.find(ticket) == requests.end()) return false;
+        done_cv.wait(lock, [&]() { return requests[ticket]->done; });
+
+        Request* request = requests[ticket];
+        bool ok = request->error == 0;
+        data.swap(request->data);
+        requests.erase(ticket);
+        delete request;
+        return ok;
+    }
+
+    void submitWrite(const std::string& filename, std::vector<unsigned char>& data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_writes++;
+        start(lock, filename, true, &data);
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&]() { return pending_writes == 0; });
+    }
+
+    const char* name() const { return "io_uring"; }
+
+private:
+    enum { OPENING, TRANSFER, CLOSING };
+
+    // user_data of the no-op which stops the completion thread
+    static const unsigned long long STOP_TICKET = ~0ull;
+
+    struct Request {
+        bool write;
+        std::string filename;
+        std::vector<unsigned char> data;
+        size_t offset;
+        int fd;
+        int slot;
+        int state;
+        int error;
+        bool done;
+    };
+
+    void release() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr) munmap(sq_ptr, sq_size);
+        close(ring_fd);
+        ring_fd = -1;
+    }
+
+    // the lock is held by the caller
+    int start(std::unique_lock<std::mutex>& lock, const std::string& filename, bool write,
+              std::vector<unsigned char>* data) {
+        // wait for a free buffer slot
+        done_cv.wait(lock, [&]() { return !free_slots.empty(); });
+
+        Request* request = new Request();
+        request->write = write;
+        request->filename = filename;
+        if (data) request->data.swap(*data);
+        request->offset = 0;
+        request->fd = -1;
+        request->slot = free_slots.back();
+        request->state = OPENING;
+        request->error = 0;
+        request->done = false;
+        free_slots.pop_back();
+
+        int ticket = next_ticket++;
+        requests[ticket] = request;
+        issue(ticket);
+        return ticket;
+    }
+
+    // the submission entry at the tail, cleared
+    io_uring_sqe* nextEntry() {
+        io_uring_sqe* sqe = &sqes[*sq_tail & *sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // hand the entry at the tail to the kernel
+    void push() {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+        if (ret > 0) to_submit -= std::min((unsigned)ret, to_submit);
+    }
+
+    // queue the operation of the current request state
+    void issue(int ticket) {
+        Request* request = requests[ticket];
+        unsigned char* slot = &buffers[request->slot * SLOT_SIZE];
+
+        io_uring_sqe* sqe = nextEntry();
+        sqe->user_data = ticket;
+
+        if (request->state == OPENING) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)request->filename.c_str();
+            sqe->len = 0644;
+            sqe->open_flags = request->write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+        }
+        else if (request->state == TRANSFER) {
+            size_t length = SLOT_SIZE;
+            if (request->write) {
+                length = std::min(length, request->data.size() - request->offset);
+                memcpy(slot, &request->data[request->offset], length);
+            }
+            sqe->opcode = request->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->fd = request->fd;
+            sqe->addr = (uintptr_t)slot;
+            sqe->len = length;
+            sqe->off = request->offset;
+            sqe->buf_index = request->slot;
+        }
+        else {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = request->fd;
+        }
+        push();
+    }
+
+    // completion thread: sleep in the ring without the lock, then handle every available completion
+    void complete() {
+        while (true) {
+            syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                unsigned long long ticket = cqe->user_data;
+                int res = cqe->res;
+                head++;
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                if (ticket != STOP_TICKET)
+                    advance(ticket, res);
+            }
+            done_cv.notify_all();
+            if (stop) return;
+        }
+    }
+
+    // move a request to its next state
+    void advance(int ticket, int res) {
+        Request* request = requests[ticket];
+
+        if (res == -EINTR || res == -EAGAIN) {
+            issue(ticket);
+            return;
+        }
+
+        if (request->state == OPENING) {
+            if (res < 0) {
+                request->error = -res;
+                finish(ticket);
+                return;
+            }
+            request->fd = res;
+            request->state = request->write && request->data.empty() ? CLOSING : TRANSFER;
+        }
+        else if (request->state == TRANSFER) {
+            if (res < 0) {
+                request->error = -res;
+                request->state = CLOSING;
+            }
+            else if (request->write) {
+                request->offset += res;
+                if (res == 0) request->error = EIO;
+                if (res == 0 || request->offset == request->data.size()) request->state = CLOSING;
+            }
+            else {
+                // keep reading chunks until the end of file
+                unsigned char* slot = &buffers[request->slot * SLOT_SIZE];
+                request->data.insert(request->data.end(), slot, slot + res);
+                request->offset += res;
+                if (res == 0) request->state = CLOSING;
+            }
+        }
+        else {
+            finish(ticket);
+            return;
+        }
+        issue(ticket);
+    }
+
+    void finish(int ticket) {
+        Request* request = requests[ticket];
+        free_slots.push_back(request->slot);
+        request->done = true;
+
+        // nobody waits for a write
+        if (request->write) {
+            if (request->error)
+                std::cerr << "Can not write " << request->filename << ": " << strerror(request->error) << std::endl;
+            requests.erase(ticket);
+            delete request;
+            pending_writes--;
+        }
+    }
+
+    int ring_fd;
+    unsigned char *sq_ptr, *cq_ptr;
+    io_uring_sqe* sqes;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes;
+    unsigned to_submit;
+
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    std::thread completion_thread;
+    std::vector<unsigned char> buffers;
+    std::vector<int> free_slots;
+    std::map<int, Request*> requests;
+    int next_ticket;
+    int pending_writes;
+    bool stop;
+};
+#endif
+
+// io_uring when asked for and supported by the kernel, worker threads otherwise
+inline AsyncIO* createAsyncIO(int depth, bool use_io_uring) {
+#ifdef HAVE_IO_URING
+    if (use_io_uring) {
+        IOUringIO* io = new IOUringIO(depth);
+        if (io->valid()) return io;
+        delete io;
+    }
+#endif
+    return new ThreadPoolIO(depth);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include "transform.h"
+
+/*
+    Macroblock syntax shared by the encoder and the decoder. The values and tables
+    here define the bitstream, so both tools take them from this one place.
+*/
+
+// picture header: PN, PL and PW, the size fields are this wide and MN has MN_BITS
+#define PN_BITS 8
+#define SIZE_BITS 10
+#define MN_BITS 12
+
+// extended picture header for pictures wider or higher than PL and PW can carry:
+// PL and PW are both zero, which no picture can be, and the size follows in EXT_SIZE_BITS;
+// MN then has EXT_MN_BITS, parsing MN that wide also reads the MN_BITS field
+#define EXT_SIZE_BITS 16
+#define EXT_MN_BITS 24
+
+// whether a picture of this size needs the extended header
+inline bool needsExtendedHeader(int cols, int rows) {
+    return cols >= 1 << SIZE_BITS || rows >= 1 << SIZE_BITS;
+}
+
+// whether parsed PL and PW announce the extended header
+inline bool isExtendedHeader(int pl, int pw) {
+    return pl == 0 && pw == 0;
+}
+
+// MTYPE of the macroblock header
+#define MTYPE_INTRA 1           // 8 bit DC term
+#define MTYPE_INTER 2
+#define MTYPE_INTRA_PRED 3      // DC term coded as the difference to its prediction
+
+// DC prediction of the first intra macroblock of a row and after an inter macroblock, mid gray
+#define DC_PREDICTION_RESET 64
+#define DC_SIZE_CATEGORIES 12
+
+// size category of a predicted DC difference, the difference follows in that many bits
+static const char* const dc_size_code[DC_SIZE_CATEGORIES] = {
+    "00", "010", "011", "100", "101", "110", "1110", "11110", "111110", "1111110", "11111110", "111111110"
+};
+
+// DC term which block k of a macroblock is predicted from
+inline int dcPrediction(const int left_dc[BLOCKS_PER_MB], const int dc[BLOCKS_PER_MB], const int k) {
+    // Y2 and Y4 are predicted from Y1 and Y3 of the same macroblock,
+    // Y1 and Y3 from Y2 and Y4 of the left one and Cb, Cr from Cb, Cr of the left one
+    if (k == 0) return left_dc[1];
+    if (k == 1) return dc[0];
+    if (k == 2) return left_dc[3];
+    if (k == 3) return dc[2];
+    return left_dc[k];
+}
+
+#endif
@@ -3,7 +3,21 @@
 #include <bitset>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <memory>
 #include <opencv2/opencv.hpp>
+#include "transform.h"
+#include "async_io.h"
+#include "scheduler.h"
+#include "geometry.h"
+#include "bitstream.h"
+#include "huffman.h"
 
 using namespace std;
 using namespace cv;
@@ -13,186 +27,787 @@ using namespace cv;
 #define INTRA true
 #define INTER false
 
+// the longest VLC, the lookup table has an entry for every prefix of this length,
+// a sequence table is limited to HUFFMAN_MAX_LENGTH so it fits as well
+#define VLC_TABLE_BITS 14
+
+// parsed macroblock header
+struct MacroblockInfo {
+    int mn;
+    bool frame_type;
+    int mvh;
+    int mvv;
+};
+
+// reference picture and the buffers the next picture is rebuilt into, reused while the size stays
+struct DecodeBuffers {
+    Mat cache_img;  // last picture in YCrCb
+    Mat work_img;   // picture being rebuilt, swapped with cache_img when done
+    Mat rgb_img;    // output picture, converted stripe by stripe
+};
+
+// pictures from an I frame up to the next one, they never reference a picture outside
+struct PictureGroup {
+    vector<int> nums;
+    vector<string> codes;
+    vector<bool> read_ok;
+};
+
+// a rebuilt picture waiting for its turn to be written
+struct DecodedPicture {
+    bool ok;
+    vector<uchar> data;
+};
+
+// pictures decoded out of order wait here until all earlier ones are written
+struct ReorderQueue {
+    mutex lock;
+    map<int, DecodedPicture> pending;
+    int next;
+};
+
+// one entry of the VLC lookup table
+struct VLCEntry {
+    int length;     // bits of the code starting with the prefix, 0 if none does
+    bool escape;    // run and level follow in 6 and 8 bits
+    int run;
+    int level;
+};
+
 map<string, string> decode_dict;
+int sequence_table_id = DEFAULT_TABLE_ID;   // VLC table of code/sequence.txt
+vector<VLCEntry> vlc_table;
+
+// decoder settings, can be changed from command line
+bool preview_mode = false;  // decode 1/8 scale frames from the DC terms only
+bool analyze_mode = false;  // only parse macroblock metadata into analysis.jsonl
+int thread_count = 1;       // GOP-parallel decoding on this many threads, 0 means one per core
+bool use_fixed_geometry = true;  // specialised pipelines for QCIF and CIF pictures
+int io_depth = 4;           // code reads and picture writes in flight
+bool use_io_uring = true;   // io_uring when the kernel supports it, worker threads otherwise
+
+// asynchronous file access
+AsyncIO* io = NULL;
+vector<int> read_tickets;
+
+// sequential decoding statistics
+double decode_time = 0;
+double intra_decode_time = 0;
+int intra_picture_count = 0;
+int geometry_count[GEOMETRY_KINDS] = {0};
+
+void parseArguments(int argc, char* argv[]);
+
+string frameNumber(int num);
+
+void submitCodeRead(int num);
+
+bool loadCode(int num, string& code);
+
+bool loadCode(int num, istringstream& ifs);
+
+bool isIntraPicture(const string& code);
+
+int readPictureHeader(istream& ifs, int& img_num, int& img_cols, int& img_rows, int& table_id);
+
+void saveImage(const string& filename, const Mat& img);
 
 void initDecodeDict();
 
+void initVLCTable();
+
+bool loadSequenceTable();
+
 void zigzagStep(int &x, int &y, bool &flag);
 
-void frameDecode(int num, Mat& cache_img);
+void frameDecode(int num, DecodeBuffers& buffers);
+
+int pictureDecode(istream& ifs, DecodeBuffers& buffers, bool& intra);
+
+bool validMacroblock(const int mn, const bool frame_type, const int mvh, const int mvv, const Mat& cache_img,
+                     const Size& size);
+
+template<class Geometry>
+bool pictureDecode(istream& ifs, DecodeBuffers& buffers, const Geometry& geo, bool& intra);
+
+void parallelDecode(int threads);
+
+void groupDecode(const PictureGroup& group, ReorderQueue& queue);
+
+void submitPicture(ReorderQueue& queue, int num, DecodedPicture& picture);
+
+void framePreviewDecode(int num, Mat& cache_preview);
+
+void frameAnalyze(int num, ofstream& ofs);
+
+int readBits(const string& code, size_t& pos, const int count);
+
+bool decodeRunLevel(const string& code, size_t& pos, int& run, int& level);
+
+int decodeIntraDC(const string& code, size_t& pos, const bool predicted, const int prediction);
 
-void decodeFixedBlock(Mat& block, ifstream& ifs);
+int decodeIntraBlock(Mat& block, istream& ifs, const bool predicted, const int prediction);
 
-void decodeVariableLengthBlock(Mat& block, ifstream& ifs);
+void decodeInterBlock(Mat& block, istream& ifs);
 
-int main(void) {
-    // init VLC decode dict
+int decodeBlockDC(istream& ifs, const int mtype, const int prediction);
+
+int countBlockCoeff(const string& code, const int mtype);
+
+int main(int argc, char* argv[]) {
+    // load decoder settings
+    parseArguments(argc, argv);
+
+    // init VLC decode dict and the lookup table built from it
     initDecodeDict();
+    initVLCTable();
+
+    // start reading the first code files
+    io = createAsyncIO(io_depth, use_io_uring);
+    cout << "I/O backend: " << io->name() << endl;
+
+    // a two-pass sequence brings its own VLC table, pictures which name another table are not decoded
+    if (loadSequenceTable())
+        cout << "VLC table: " << (sequence_table_id == DEFAULT_TABLE_ID ? "default" : "sequence") << endl;
+    read_tickets.assign(113 + 1, -1);
+    for (int i = 1; i <= min(io_depth, 113); i++)
+        submitCodeRead(i);
 
     // init a cache frame
     Mat cache_img;
+    DecodeBuffers buffers;
+
+    // metadata stream of the analyze mode
+    ofstream analysis_ofs;
+    if (analyze_mode)
+        analysis_ofs.open("analysis.jsonl", ofstream::out);
 
     // decode the image sequence
-    for (int i = 1; i <= 113; i++) {
-        frameDecode(i, cache_img);
+    int threads = thread_count > 0 ? thread_count : max(1, (int)thread::hardware_concurrency());
+    if (!analyze_mode && !preview_mode && threads > 1)
+        parallelDecode(threads);
+    else {
+        for (int i = 1; i <= 113; i++) {
+            if (analyze_mode) frameAnalyze(i, analysis_ofs);
+            else if (preview_mode) framePreviewDecode(i, cache_img);
+            else frameDecode(i, buffers);
+        }
+    }
+
+    if (!analyze_mode && !preview_mode && threads == 1) {
+        cout << "Average decode time per picture: " << decode_time * 1000 / 113 << " ms (";
+        for (int k = 0, first = 1; k < GEOMETRY_KINDS; k++) {
+            if (geometry_count[k] == 0) continue;
+            cout << (first ? "" : ", ") << geometryName(k) << " pipeline: " << geometry_count[k];
+            first = 0;
+        }
+        cout << " pictures)" << endl;
+        if (intra_picture_count > 0)
+            cout << "Average decode time per I frame: " << intra_decode_time * 1000 / intra_picture_count << " ms" << endl;
     }
 
+    // wait for the last pictures
+    delete io;
+
     return 0;
 }
 
-void frameDecode(int num, Mat& cache_img) {
-    cout << "***** Decoding picture " << num << ". *****" << endl;
-    
-    /*** load code ***/
-    // construct file name
+void parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--preview") == 0)
+            preview_mode = true;
+        else if (strcmp(argv[i], "--analyze") == 0)
+            analyze_mode = true;
+        else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc)
+            use_io_uring = strcmp(argv[++i], "threads") != 0;
+        else if (strcmp(argv[i], "--io-depth") == 0 && i + 1 < argc)
+            io_depth = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            thread_count = max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--generic-geometry") == 0)
+            use_fixed_geometry = false;
+        else {
+            cout << "Usage: " << argv[0] << " [--preview] [--analyze] [--io uring|threads] [--io-depth n] [--threads n]"
+                 << " [--generic-geometry]" << endl;
+            exit(1);
+        }
+    }
+}
+
+string frameNumber(int num) {
     stringstream ss;
     ss << num;
     string number = ss.str();
     while (number.length() < 4)
         number.insert(0, 1, '0');
-    string read_filename = "code/" + number + ".txt";
+    return number;
+}
+
+void submitCodeRead(int num) {
+    string read_filename = "code/" + frameNumber(num) + ".txt";
+    read_tickets[num] = io->submitRead(read_filename);
+}
 
-    // open file
-    ifstream ifs;
-    ifs.open(read_filename.c_str(), ifstream::in);
+bool loadCode(int num, string& code) {
+    // wait for the prefetched file and keep the read queue full
+    vector<uchar> data;
+    bool read_ok = io->waitRead(read_tickets[num], data);
+    if (num + io_depth <= 113)
+        submitCodeRead(num + io_depth);
+
+    code.assign(data.begin(), data.end());
+    if (!read_ok)
+        return false;
+
+    // a picture coded with another table than the loaded one would decode to garbage
+    istringstream ifs(code);
+    int img_num, img_cols, img_rows, table_id;
+    readPictureHeader(ifs, img_num, img_cols, img_rows, table_id);
+    if (table_id != sequence_table_id) {
+        cout << "Picture " << num << " is coded with VLC table " << table_id << ", code/sequence.txt has table "
+             << sequence_table_id << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+bool loadCode(int num, istringstream& ifs) {
+    string code;
+    bool read_ok = loadCode(num, code);
+    ifs.str(code);
+    return read_ok;
+}
+
+bool isIntraPicture(const string& code) {
+    // only the macroblock headers are read, coded blocks are skipped line by line
+    istringstream ifs(code);
+    int img_num, img_cols, img_rows, table_id;
+    readPictureHeader(ifs, img_num, img_cols, img_rows, table_id);
+
+    string MN, MTYPE, MQUANT, MV, CBP, block;
+    while (ifs >> MN >> MTYPE >> MQUANT >> MV >> CBP) {
+        int mtype = bitset<2>(MTYPE).to_ulong();
+        if (mtype != MTYPE_INTRA && mtype != MTYPE_INTRA_PRED)
+            return false;
+        int coded = bitset<6>(CBP).count();
+        for (int l = 0; l < coded; l++)
+            ifs >> block;
+    }
+    return true;
+}
+
+void saveImage(const string& filename, const Mat& img) {
+    // encode in memory and queue the write
+    vector<uchar> data;
+    imencode(".jpg", img, data);
+    io->submitWrite(filename, data);
+}
+
+void frameDecode(int num, DecodeBuffers& buffers) {
+    cout << "***** Decoding picture " << num << ". *****" << endl;
+    
+    /*** load code ***/
+    // construct file name
+    string number = frameNumber(num);
+
+    // wait for the prefetched code
+    istringstream ifs;
+    if (!loadCode(num, ifs)) {
+        cout << "Can not read code " << number << "." << endl;
+        return;
+    }
+
+    int64 start_tick = getTickCount();
+    bool intra;
+    int kind = pictureDecode(ifs, buffers, intra);
+    if (kind < 0) {
+        cout << "Bad code " << number << ", the picture is skipped." << endl;
+        return;
+    }
+    geometry_count[kind]++;
+    double time = (getTickCount() - start_tick) / getTickFrequency();
+    decode_time += time;
+    if (intra) {
+        intra_decode_time += time;
+        intra_picture_count++;
+    }
+
+    // write into file
+    string output_filename = "rebuild/" + number + ".jpg";
+    saveImage(output_filename, buffers.rgb_img);
+}
 
+int readPictureHeader(istream& ifs, int& img_num, int& img_cols, int& img_rows, int& table_id) {
     // load PN, PL, PW
     string PN, PL, PW;
     ifs >> PN >> PL >> PW;
-    int img_num = bitset<8>(PN).to_ulong();
-    int img_cols = bitset<10>(PL).to_ulong();
-    int img_rows = bitset<10>(PW).to_ulong();
+    img_num = bitset<PN_BITS>(PN).to_ulong();
+    img_cols = bitset<SIZE_BITS>(PL).to_ulong();
+    img_rows = bitset<SIZE_BITS>(PW).to_ulong();
+    int bits = PN.length() + PL.length() + PW.length();
+
+    // a picture can not be empty, zero announces the extended size
+    if (isExtendedHeader(img_cols, img_rows)) {
+        string EPL, EPW;
+        ifs >> EPL >> EPW;
+        img_cols = bitset<EXT_SIZE_BITS>(EPL).to_ulong();
+        img_rows = bitset<EXT_SIZE_BITS>(EPW).to_ulong();
+        bits += EPL.length() + EPW.length();
+    }
+
+    // the VLC table the run-level pairs are coded with
+    string VT;
+    ifs >> VT;
+    table_id = bitset<TABLE_ID_BITS>(VT).to_ulong();
+    bits += VT.length();
+    return bits;
+}
 
-    // init a Mat for reconstruct frame and convert its color space
-    Mat img = Mat::zeros(Size(img_cols, img_rows), CV_8UC3);
-    cvtColor(img, img, CV_RGB2YCrCb);
+int pictureDecode(istream& ifs, DecodeBuffers& buffers, bool& intra) {
+    int img_num, img_cols, img_rows, table_id;
+    readPictureHeader(ifs, img_num, img_cols, img_rows, table_id);
+
+    // the standard picture sizes run a copy with the macroblock grid as constants
+    int kind = geometryKind(img_cols, img_rows, use_fixed_geometry);
+    bool ok;
+    if (kind == GEOMETRY_QCIF)
+        ok = pictureDecode(ifs, buffers, QCIFGeometry(), intra);
+    else if (kind == GEOMETRY_CIF)
+        ok = pictureDecode(ifs, buffers, CIFGeometry(), intra);
+    else
+        ok = pictureDecode(ifs, buffers, RuntimeGeometry(img_cols, img_rows), intra);
+    return ok ? kind : -1;
+}
+
+bool validMacroblock(const int mn, const bool frame_type, const int mvh, const int mvv, const Mat& cache_img,
+                     const Size& size) {
+    // the kernels read and write the frames through raw pointers, so a bad MN or vector must not reach them
+    const int mb_cols = size.width / 16;
+    if (mn >= mb_cols * (size.height / 16)) return false;
+    if (frame_type == INTRA) return true;
+
+    // the reference block lies in a cache frame of the same size, in the range of the motion search of the encoder
+    if (cache_img.empty() || cache_img.size() != size) return false;
+    int ref_pos_x = (16 * (mn / mb_cols) + 16) / 2 + mvv;
+    int ref_pos_y = (16 * (mn % mb_cols) + 16) / 2 + mvh;
+    return ref_pos_x >= 8 && ref_pos_x <= size.height - 8 && ref_pos_y >= 8 && ref_pos_y <= size.width - 8;
+}
+
+// false when the code is damaged, intra tells whether every macroblock was intra
+template<class Geometry>
+bool pictureDecode(istream& ifs, DecodeBuffers& buffers, const Geometry& geo, bool& intra) {
+    const Mat& cache_img = buffers.cache_img;
+
+    // init a Mat for reconstruct frame and convert its color space, only when the size changes
+    // every macroblock is rebuilt, the rows and columns outside the grid keep their initial value
+    Mat& img = buffers.work_img;
+    if (img.size() != Size(geo.cols, geo.rows)) {
+        img = Mat::zeros(Size(geo.cols, geo.rows), CV_8UC3);
+        cvtColor(img, img, CV_RGB2YCrCb);
+    }
+    buffers.rgb_img.create(Size(geo.cols, geo.rows), CV_8UC3);
+
+    /*** extract macroblock ***/
+    const int mb_rows = geo.mb_rows;
+    const int mb_cols = geo.mb_cols;
+
+    // coefficient batch and quantizer step of every coded block in a macroblock row
+    BlockBatch batch;
+    initBlockBatch(batch, mb_cols * BLOCKS_PER_MB);
+    vector<float> block_quant(batch.stride);
+    vector<int> block_slot(mb_cols * BLOCKS_PER_MB);
+    vector<MacroblockInfo> row_info(mb_cols);
+    intra = true;
+
+    for (int mb_row = 0; mb_row < mb_rows; mb_row++) {
+        /*** parse the whole macroblock row ***/
+        // DC terms of the left macroblock, every row starts from the reset value
+        int left_dc[BLOCKS_PER_MB];
+        fill(left_dc, left_dc + BLOCKS_PER_MB, DC_PREDICTION_RESET);
+        batch.count = 0;
+        for (int k = 0; k < mb_cols; k++) {
+            // load macroblock parameters
+            string MN, MTYPE, MQUANT, MV, CBP;
+            ifs >> MN >> MTYPE >> MQUANT >> MV >> CBP;
+            int mn = bitset<EXT_MN_BITS>(MN).to_ulong();
+            int mtype = bitset<2>(MTYPE).to_ulong();
+            int mquant = bitset<5>(MQUANT).to_ulong();
+            int mvh = bitset<5>(MV.substr(0, 5)).to_ulong();
+            int mvv = bitset<5>(MV.substr(5)).to_ulong();
+            int cbp = bitset<6>(CBP).to_ulong();
+            bool frame_type = mtype == MTYPE_INTER ? INTER : INTRA;
+            intra = intra && frame_type == INTRA;
+
+            // fix the sign of mv
+            mvh = mvh > 16 ? mvh - 32 : mvh;
+            mvv = mvv > 16 ? mvv - 32 : mvv;
+
+            // refuse the picture before a bad MN or vector reaches the kernels
+            if (!validMacroblock(mn, frame_type, mvh, mvv, cache_img, Size(geo.cols, geo.rows)))
+                return false;
+
+            MacroblockInfo& info = row_info[k];
+            info.mn = mn;
+            info.frame_type = frame_type;
+            info.mvh = mvh;
+            info.mvv = mvv;
+
+            // decode Y1, Y2, Y3, Y4, Cb, Cr coeffient optionly by cbp value
+            // blocks which are not coded get no slot and skip the inverse transform
+            // a block which is not coded has a zero DC term
+            Mat quant = Mat::zeros(Size(8, 8), CV_32F);
+            int dc[BLOCKS_PER_MB] = {0};
+            for (int l = 0; l < BLOCKS_PER_MB; l++) {
+                int& slot = block_slot[k * BLOCKS_PER_MB + l];
+                slot = -1;
+                if (!(cbp & (32 >> l))) continue;
+
+                quant = Scalar(0);
+                if (frame_type) dc[l] = decodeIntraBlock(quant, ifs, mtype == MTYPE_INTRA_PRED, dcPrediction(left_dc, dc, l));
+                else decodeInterBlock(quant, ifs);
+                slot = addBlock(batch);
+                block_quant[slot] = mquant;
+                loadBlock(batch, slot, quant);
+            }
+
+            // only intra macroblocks predict the DC terms of the next one
+            if (frame_type == INTRA)
+                copy(dc, dc + BLOCKS_PER_MB, left_dc);
+            else
+                fill(left_dc, left_dc + BLOCKS_PER_MB, DC_PREDICTION_RESET);
+        }
+
+        // inverse quantity and inverse dct of all blocks in the row
+        dequantizeBatch(batch, block_quant);
+        transformBatch(batch, batch, true);
+
+        for (int k = 0; k < mb_cols; k++) {
+            const MacroblockInfo& info = row_info[k];
+
+            // get the macro block position(left top)
+            int row = 16 * (info.mn / mb_cols);
+            int col = 16 * (info.mn % mb_cols);
+
+            /*** motion compensation ***/
+            const uchar* ref = NULL;
+            if (info.frame_type == INTER) {
+                // get reference frame's marco block
+                int ref_pos_x = (row + 16) / 2 + info.mvv;
+                int ref_pos_y = (col + 16) / 2 + info.mvh;
+                ref = cache_img.data + (ref_pos_x - 8) * geo.step + (ref_pos_y - 8) * 3;
+            }
+
+            /*** reconstruct image macro block ***/
+            reconstructMacroblock(batch, &block_slot[k * BLOCKS_PER_MB], ref, geo.step,
+                                  img.data + row * geo.step + col * 3, geo.step);
+        }
+
+        // convert the finished stripe for the output while it is hot, the last row also takes the rows below the grid
+        int stripe_end = mb_row == mb_rows - 1 ? geo.rows : mb_row * 16 + 16;
+        Mat rgb_stripe = buffers.rgb_img.rowRange(mb_row * 16, stripe_end);
+        cvtColor(img.rowRange(mb_row * 16, stripe_end), rgb_stripe, COLOR_YCrCb2RGB);
+    }
+
+    // the rebuilt picture becomes the cache img, the old one is rebuilt next time
+    swap(buffers.cache_img, buffers.work_img);
+    return intra;
+}
+
+void parallelDecode(int threads) {
+    // every worker decodes whole groups with its own reference picture
+    setNumThreads(0);
+    FairSharePool pool(threads);
+    int pool_group = pool.addGroup(1);
+    ReorderQueue queue;
+    queue.next = 1;
+    int64 start_tick = getTickCount();
+
+    // split the sequence at its I frames while the code is read
+    int group_count = 0;
+    shared_ptr<PictureGroup> group(new PictureGroup());
+    for (int i = 1; i <= 113; i++) {
+        string code;
+        bool read_ok = loadCode(i, code);
+
+        // a picture which can not be read stays in the running group, like in sequential decoding
+        if (read_ok && isIntraPicture(code) && !group->nums.empty()) {
+            pool.submit(pool_group, [group, &queue]() { groupDecode(*group, queue); });
+            group_count++;
+            group.reset(new PictureGroup());
+        }
+        group->nums.push_back(i);
+        group->codes.push_back(code);
+        group->read_ok.push_back(read_ok);
+    }
+    pool.submit(pool_group, [group, &queue]() { groupDecode(*group, queue); });
+    group_count++;
+    pool.wait();
+
+    double time = (getTickCount() - start_tick) / getTickFrequency();
+    cout << "Decoded " << group_count << " picture groups on " << threads << " threads, "
+         << 113 / time << " frames/s." << endl;
+}
+
+void groupDecode(const PictureGroup& group, ReorderQueue& queue) {
+    DecodeBuffers buffers;
+    for (size_t k = 0; k < group.nums.size(); k++) {
+        DecodedPicture picture;
+        picture.ok = group.read_ok[k];
+        if (picture.ok) {
+            istringstream ifs(group.codes[k]);
+            bool intra;
+            picture.ok = pictureDecode(ifs, buffers, intra) >= 0;
+
+            // the picture is compressed here, so the queue only holds small buffers
+            if (picture.ok)
+                imencode(".jpg", buffers.rgb_img, picture.data);
+        }
+        submitPicture(queue, group.nums[k], picture);
+    }
+}
+
+void submitPicture(ReorderQueue& queue, int num, DecodedPicture& picture) {
+    // take every picture whose predecessors are all written, the writes are queued after the lock
+    vector<pair<string, vector<uchar> > > writes;
+    {
+        lock_guard<mutex> lock(queue.lock);
+        queue.pending[num].ok = picture.ok;
+        queue.pending[num].data.swap(picture.data);
+
+        while (queue.pending.count(queue.next)) {
+            DecodedPicture& next = queue.pending[queue.next];
+            string number = frameNumber(queue.next);
+            cout << "***** Decoding picture " << queue.next << ". *****" << endl;
+            if (next.ok) {
+                writes.push_back(make_pair("rebuild/" + number + ".jpg", vector<uchar>()));
+                writes.back().second.swap(next.data);
+            }
+            else
+                cout << "Can not read or decode code " << number << "." << endl;
+            queue.pending.erase(queue.next);
+            queue.next++;
+        }
+    }
+    for (size_t k = 0; k < writes.size(); k++)
+        io->submitWrite(writes[k].first, writes[k].second);
+}
+
+void framePreviewDecode(int num, Mat& cache_preview) {
+    cout << "***** Previewing picture " << num << ". *****" << endl;
+    
+    /*** load code ***/
+    // construct file name
+    string number = frameNumber(num);
+
+    // wait for the prefetched code
+    istringstream ifs;
+    if (!loadCode(num, ifs)) {
+        cout << "Can not read code " << number << "." << endl;
+        return;
+    }
+
+    // load PN, PL, PW
+    int img_num, img_cols, img_rows, table_id;
+    readPictureHeader(ifs, img_num, img_cols, img_rows, table_id);
+
+    // init a 1/8 scale frame, one pixel for every 8x8 block
+    Mat preview = Mat::zeros(Size(img_cols / 8, img_rows / 8), CV_8UC3);
+    cvtColor(preview, preview, CV_RGB2YCrCb);
 
     /*** extract macroblock ***/
     int mb_rows = img_rows / 16;
     int mb_cols = img_cols / 16;
     int mb_count = mb_rows * mb_cols;
-    while (mb_count--) {
+    int left_dc[BLOCKS_PER_MB];
+    for (int k = 0; k < mb_count; k++) {
+        // DC terms of the left macroblock, every row starts from the reset value
+        if (k % mb_cols == 0)
+            fill(left_dc, left_dc + BLOCKS_PER_MB, DC_PREDICTION_RESET);
+
         // load macroblock parameters
         string MN, MTYPE, MQUANT, MV, CBP;
         ifs >> MN >> MTYPE >> MQUANT >> MV >> CBP;
-        int mn = bitset<12>(MN).to_ulong();
+        int mn = bitset<EXT_MN_BITS>(MN).to_ulong();
         int mtype = bitset<2>(MTYPE).to_ulong();
         int mquant = bitset<5>(MQUANT).to_ulong();
         int mvh = bitset<5>(MV.substr(0, 5)).to_ulong();
         int mvv = bitset<5>(MV.substr(5)).to_ulong();
         int cbp = bitset<6>(CBP).to_ulong();
-        bool frame_type = mtype == 1 ? INTRA : INTER;
+        bool frame_type = mtype == MTYPE_INTER ? INTER : INTRA;
 
         // fix the sign of mv
         mvh = mvh > 16 ? mvh - 32 : mvh;
         mvv = mvv > 16 ? mvv - 32 : mvv;
 
-        // create macro block coeffient container
-        Mat quant_y = Mat::zeros(Size(16, 16), CV_32F);
-        Mat quant_cb = Mat::zeros(Size(8, 8), CV_32F);
-        Mat quant_cr = Mat::zeros(Size(8, 8), CV_32F);
-
-        // split quant_y 
-        Mat quant_y_1(quant_y, Rect(0, 0, 8, 8));
-        Mat quant_y_2(quant_y, Rect(8, 0, 8, 8));
-        Mat quant_y_3(quant_y, Rect(0, 8, 8, 8));
-        Mat quant_y_4(quant_y, Rect(8, 8, 8, 8));
-
-        // decode coeffient optionly by cbp value
-        if (cbp & 32) {
-            if (frame_type) decodeFixedBlock(quant_y_1, ifs);
-            else decodeVariableLengthBlock(quant_y_1, ifs);
+        // the reference is clamped into the preview, only a bad MN or a missing reference is refused
+        if (mn >= mb_count || (frame_type == INTER && cache_preview.size() != preview.size())) {
+            cout << "Bad code " << number << ", the preview is skipped." << endl;
+            return;
         }
-        if (cbp & 16) {
-            if (frame_type) decodeFixedBlock(quant_y_2, ifs);
-            else decodeVariableLengthBlock(quant_y_2, ifs);
-        }
-        if (cbp & 8) {
-            if (frame_type) decodeFixedBlock(quant_y_3, ifs);
-            else decodeVariableLengthBlock(quant_y_3, ifs);
-        }
-        if (cbp & 4) {
-            if (frame_type) decodeFixedBlock(quant_y_4, ifs);
-            else decodeVariableLengthBlock(quant_y_4, ifs);
+
+        // the DC term divided by 8 is the mean of an 8x8 block
+        float mean[BLOCKS_PER_MB] = {0};
+        int dc[BLOCKS_PER_MB] = {0};
+        for (int l = 0; l < BLOCKS_PER_MB; l++) {
+            if (cbp & (32 >> l))
+                dc[l] = decodeBlockDC(ifs, mtype, dcPrediction(left_dc, dc, l));
+            mean[l] = dc[l] * mquant / 8.0f;
         }
-        if (cbp & 2) {
-            if (frame_type) decodeFixedBlock(quant_cb, ifs);
-            else decodeVariableLengthBlock(quant_cb, ifs);
+        if (frame_type == INTRA)
+            copy(dc, dc + BLOCKS_PER_MB, left_dc);
+        else
+            fill(left_dc, left_dc + BLOCKS_PER_MB, DC_PREDICTION_RESET);
+
+        // get the macro block position(left top) in the preview
+        int row = 2 * (mn / mb_cols);
+        int col = 2 * (mn % mb_cols);
+
+        // scale the left top of the reference macroblock
+        int ref_row = 0, ref_col = 0;
+        if (frame_type == INTER) {
+            ref_row = cvRound(((row * 8 + 16) / 2 + mvv - 8) / 8.0);
+            ref_col = cvRound(((col * 8 + 16) / 2 + mvh - 8) / 8.0);
+            ref_row = min(max(ref_row, 0), preview.rows - 2);
+            ref_col = min(max(ref_col, 0), preview.cols - 2);
         }
-        if (cbp & 1) {
-            if (frame_type) decodeFixedBlock(quant_cr, ifs);
-            else decodeVariableLengthBlock(quant_cr, ifs);
+
+        /*** reconstruct the 2x2 pixels of the macroblock ***/
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                Vec3b pred(0, 0, 0);
+                if (frame_type == INTER)
+                    pred = cache_preview.at<Vec3b>(ref_row + i, ref_col + j);
+
+                // Y1, Y2, Y3, Y4 cover one pixel each, Cb and Cr the whole macroblock
+                Vec3b& pixel = preview.at<Vec3b>(row + i, col + j);
+                pixel[0] = saturate_cast<uchar>(pred[0] + mean[i * 2 + j]);
+                pixel[1] = saturate_cast<uchar>(pred[1] + mean[5]);
+                pixel[2] = saturate_cast<uchar>(pred[2] + mean[4]);
+            }
         }
+    }
 
-        // inverse quantity
-        Mat dct_y, dct_cr, dct_cb;
-        dct_y = quant_y * mquant;
-        dct_cr = quant_cr * mquant;
-        dct_cb = quant_cb * mquant;
+    // save preview to cache preview in YCrCb
+    preview.copyTo(cache_preview);
 
-        // inverse dct
-        Mat y, cr, cb;
-        dct(dct_y, y, cv::DCT_INVERSE);
-        dct(dct_cr, cr, cv::DCT_INVERSE);
-        dct(dct_cb, cb, cv::DCT_INVERSE);
+    // write into file
+    cv::cvtColor(preview, preview, cv::COLOR_YCrCb2RGB);
+    string output_filename = "preview/" + number + ".jpg";
+    saveImage(output_filename, preview);
+}
 
-        // get the macro block position(left top)
-        int row = 16 * (mn / mb_cols);
-        int col = 16 * (mn % mb_cols);
+void frameAnalyze(int num, ofstream& ofs) {
+    cout << "***** Analyzing picture " << num << ". *****" << endl;
+    
+    /*** load code ***/
+    // construct file name
+    string number = frameNumber(num);
 
-        /*** motion compensation ***/
-        if (frame_type == INTER) {
-            // get reference frame's marco block
-            int ref_pos_x = (row + 16) / 2 + mvv;
-            int ref_pos_y = (col + 16) / 2 + mvh;
-            Mat ref_mb(cache_img, Rect(ref_pos_y - 8, ref_pos_x - 8, 16, 16));
-
-            // extract three channel of ref mb
-            Mat ref_y = Mat::zeros(Size(16, 16), CV_32F);
-            Mat ref_cr = Mat::zeros(Size(8, 8), CV_32F);
-            Mat ref_cb = Mat::zeros(Size(8, 8), CV_32F);
-            for (int i = 0; i < 16; i++) {
-                for (int j = 0; j < 16; j++) {
-                    // 4:1:1 subsampling
-                    ref_y.at<float_t>(i, j) = ref_mb.at<Vec3b>(i, j)[0];
-                    if (i % 2 == 1 && j % 2 == 0)
-                        ref_cr.at<float_t>(i / 2, j / 2) = ref_mb.at<Vec3b>(i, j)[1];
-                    if (i % 2 == 0 && j % 2 == 0)
-                        ref_cb.at<float_t>(i / 2, j / 2) = ref_mb.at<Vec3b>(i, j)[2];
-                }
-            }
+    // wait for the prefetched code
+    istringstream ifs;
+    if (!loadCode(num, ifs)) {
+        cout << "Can not read code " << number << "." << endl;
+        return;
+    }
 
-            // do the compensation
-            y = ref_y + y;
-            cr = ref_cr + cr;
-            cb = ref_cb + cb;
-        }
+    // load PN, PL, PW
+    int img_num, img_cols, img_rows, table_id;
+    int bits = readPictureHeader(ifs, img_num, img_cols, img_rows, table_id);
 
-        /*** reconstruct image macro block ***/
-        Mat img_mb(img, Rect(col, row, 16, 16));
-        for (int i = 0; i < 16; i++) {
-            for (int j = 0; j < 16; j++) {
-                // 4:1:1 upsampling
-                img_mb.at<Vec3b>(i, j)[0] = y.at<float_t>(i, j);
-                img_mb.at<Vec3b>(i, j)[1] = cr.at<float_t>(i / 2, j / 2);
-                img_mb.at<Vec3b>(i, j)[2] = cb.at<float_t>(i / 2, j / 2);
-            }
+    /*** collect macroblock metadata without decoding pixels ***/
+    stringstream mb_json;
+    int mb_rows = img_rows / 16;
+    int mb_cols = img_cols / 16;
+    int mb_count = mb_rows * mb_cols;
+    int intra_mb_count = 0;
+    for (int k = 0; k < mb_count; k++) {
+        // load macroblock parameters
+        string MN, MTYPE, MQUANT, MV, CBP;
+        ifs >> MN >> MTYPE >> MQUANT >> MV >> CBP;
+        int mn = bitset<EXT_MN_BITS>(MN).to_ulong();
+        int mtype = bitset<2>(MTYPE).to_ulong();
+        int mvh = bitset<5>(MV.substr(0, 5)).to_ulong();
+        int mvv = bitset<5>(MV.substr(5)).to_ulong();
+        int cbp = bitset<6>(CBP).to_ulong();
+        bool frame_type = mtype == MTYPE_INTER ? INTER : INTRA;
+        int mb_bits = MN.length() + MTYPE.length() + MQUANT.length() + MV.length() + CBP.length();
+
+        // fix the sign of mv
+        mvh = mvh > 16 ? mvh - 32 : mvh;
+        mvv = mvv > 16 ? mvv - 32 : mvv;
+
+        // only count the coefficients of the coded blocks
+        int coeff_count = 0;
+        for (int l = 0; l < BLOCKS_PER_MB; l++) {
+            if (!(cbp & (32 >> l))) continue;
+            string code;
+            ifs >> code;
+            mb_bits += code.length();
+            coeff_count += countBlockCoeff(code, mtype);
         }
+        bits += mb_bits;
+        if (frame_type == INTRA) intra_mb_count++;
+
+        // [MN, MTYPE, MVH, MVV, CBP, coefficients, bits]
+        if (k > 0) mb_json << ",";
+        mb_json << "[" << mn << "," << mtype << "," << mvh << "," << mvv << ","
+                << cbp << "," << coeff_count << "," << mb_bits << "]";
     }
 
-    // close file
-    ifs.close();
+    // one JSON object per line
+    ofs << "{\"picture\":" << img_num << ",\"type\":\"" << (intra_mb_count == mb_count ? "I" : "P")
+        << "\",\"width\":" << img_cols << ",\"height\":" << img_rows << ",\"bits\":" << bits
+        << ",\"macroblocks\":[" << mb_json.str() << "]}" << endl;
+}
 
-    // save img to cache img in YCrCb
-    img.copyTo(cache_img);
+int readBits(const string& code, size_t& pos, const int count) {
+    // bits past the end of the code read as zero
+    int bits = 0;
+    for (int i = 0; i < count; i++, pos++)
+        bits = bits * 2 + (pos < code.length() && code[pos] == '1');
+    return bits;
+}
 
-    // write into file
-    cv::cvtColor(img, img, cv::COLOR_YCrCb2RGB);
-    string output_filename = "rebuild/" + number + ".jpg";
-    imwrite(output_filename, img);
+bool decodeRunLevel(const string& code, size_t& pos, int& run, int& level) {
+    // look the next VLC_TABLE_BITS bits up instead of growing the code bit by bit
+    if (pos >= code.length()) return false;
+    size_t peek = pos;
+    const VLCEntry& entry = vlc_table[readBits(code, peek, VLC_TABLE_BITS)];
+    if (entry.length == 0) return false;
+    pos += entry.length;
+
+    // deal with not vlc encoded run-value pair
+    if (entry.escape) {
+        run = readBits(code, pos, 6);
+        level = readBits(code, pos, 8);
+        level = level > 128 ? level - 256 : level;
+    }
+    else {
+        run = entry.run;
+        level = entry.level;
+    }
+    return true;
+}
+
+int decodeIntraDC(const string& code, size_t& pos, const bool predicted, const int prediction) {
+    if (!predicted)
+        return readBits(code, pos, 8);
+
+    // size category of the difference, then the difference in that many bits,
+    // a negative difference is stored as the one's complement of its magnitude
+    for (int size = 0; size < DC_SIZE_CATEGORIES; size++) {
+        size_t length = strlen(dc_size_code[size]);
+        if (code.compare(pos, length, dc_size_code[size]) != 0) continue;
+        pos += length;
+        int bits = readBits(code, pos, size);
+        if (size == 0) return prediction;
+        return prediction + (bits >= (1 << (size - 1)) ? bits : bits - (1 << size) + 1);
+    }
+    pos = code.length();
+    return prediction;
 }
 
-void decodeFixedBlock(Mat& block, ifstream& ifs) {
+int decodeIntraBlock(Mat& block, istream& ifs, const bool predicted, const int prediction) {
     // init useful variable
     int x = 0, y = 0;
     bool flag = ASCEND;
@@ -201,27 +816,28 @@ void decodeFixedBlock(Mat& block, ifstream& ifs) {
     string code;
     ifs >> code;
 
-    /*** decode the run value ***/
-    while (!code.empty()) {
-        // get run and simulate the zigzag order step
-        int run = bitset<6>(code.substr(0, 6)).to_ulong();
-        code.erase(0, 6);
+    // the DC term comes first, in 8 bits or as the difference to its prediction
+    size_t pos = 0;
+    int dc = decodeIntraDC(code, pos, predicted, prediction);
+    block.at<float_t>(0, 0) = dc;
+    zigzagStep(x, y, flag);
+
+    /*** decode the run-level pairs of the AC terms ***/
+    int run, level;
+    while (decodeRunLevel(code, pos, run, level)) {
+        // get run and simulate the zigzag order steps
         while (run--) {
             zigzagStep(x, y, flag);
         }
-
-        // get value and assign the value
-        int value = bitset<9>(code.substr(0, 8)).to_ulong();
-        code.erase(0, 8);
-        value = value > 128 ? value - 256 : value;
-        block.at<float_t>(x, y) = value;
+        block.at<float_t>(x, y) = level;
 
         // move to the next step
         zigzagStep(x, y, flag);
     }
+    return dc;
 }
 
-void decodeVariableLengthBlock(Mat& block, ifstream& ifs) {
+void decodeInterBlock(Mat& block, istream& ifs) {
     // init useful variable
     int x = 0, y = 0;
     bool flag = ASCEND;
@@ -230,40 +846,53 @@ void decodeVariableLengthBlock(Mat& block, ifstream& ifs) {
     string code;
     ifs >> code;
 
-    /*** decode the run-value pair ***/
-    while (!code.empty()) {
-        // decode variable length code
-        string str;
-        int check_length = 0;
-        while (decode_dict.find(str) == decode_dict.end()) {
-            check_length++;
-            str = code.substr(0, check_length);
-        }
-        code.erase(0, check_length);
-        string run_value = decode_dict[str];
-
-        // deal with not vlc encoded run-value pair
-        if (run_value == "ESCAPE") {
-            run_value = code.substr(0, 6) + "_" + code.substr(6, 8);
-            code.erase(0, 14);
-        }
-
+    /*** decode the run-level pairs ***/
+    size_t pos = 0;
+    int run, level;
+    while (decodeRunLevel(code, pos, run, level)) {
         // get run and simulate the zigzag order steps
-        int run = bitset<6>(run_value.substr(0, 6)).to_ulong();
         while (run--) {
             zigzagStep(x, y, flag);
         }
-
-        // get value and assign the value
-        int value = bitset<9>(run_value.substr(7, 8)).to_ulong();
-        value = value > 128 ? value - 256 : value;
-        block.at<float_t>(x, y) = value;
+        block.at<float_t>(x, y) = level;
 
         // move to the next step
         zigzagStep(x, y, flag);
     }
 }
 
+int decodeBlockDC(istream& ifs, const int mtype, const int prediction) {
+    // read code of the block, only its first run-value pair can be the DC term
+    string code;
+    ifs >> code;
+
+    size_t pos = 0;
+    if (mtype != MTYPE_INTER)
+        return decodeIntraDC(code, pos, mtype == MTYPE_INTRA_PRED, prediction);
+
+    // a nonzero run means the DC term is zero
+    int run, level;
+    if (!decodeRunLevel(code, pos, run, level) || run != 0)
+        return 0;
+    return level;
+}
+
+int countBlockCoeff(const string& code, const int mtype) {
+    // an intra block always has its DC term, the prediction does not change its length
+    int count = 0;
+    size_t pos = 0;
+    if (mtype != MTYPE_INTER) {
+        decodeIntraDC(code, pos, mtype == MTYPE_INTRA_PRED, 0);
+        count++;
+    }
+
+    // walk the variable length codes without placing the values
+    int run, level;
+    while (decodeRunLevel(code, pos, run, level))
+        count++;
+    return count;
+}
+
 void zigzagStep(int &x, int &y, bool &flag) {
     if (flag == ASCEND) {
         if (x == 0 || y == 7) {
@@ -444,4 +1073,55 @@ void initDecodeDict() {
     decode_dict["00000000110111"] =     "011010_11111111";
 
     decode_dict["000001"] = "ESCAPE";
-}
\ No newline at end of file
+}
+void initVLCTable() {
+    // every table index which starts with a code decodes to that code
+    VLCEntry none = {0, false, 0, 0};
+    vlc_table.assign(1 << VLC_TABLE_BITS, none);
+    for (map<string, string>::const_iterator it = decode_dict.begin(); it != decode_dict.end(); it++) {
+        const string& code = it->first;
+        const string& run_value = it->second;
+        VLCEntry entry = {(int)code.length(), run_value == "ESCAPE", 0, 0};
+        if (!entry.escape) {
+            entry.run = bitset<6>(run_value.substr(0, 6)).to_ulong();
+            entry.level = bitset<9>(run_value.substr(7, 8)).to_ulong();
+            entry.level = entry.level > 128 ? entry.level - 256 : entry.level;
+        }
+
+        int first = bitset<VLC_TABLE_BITS>(code).to_ulong() << (VLC_TABLE_BITS - code.length());
+        for (int i = 0; i < 1 << (VLC_TABLE_BITS - code.length()); i++)
+            vlc_table[first + i] = entry;
+    }
+}
+
+bool loadSequenceTable() {
+    vector<uchar> data;
+    if (!io->waitRead(io->submitRead("code/sequence.txt"), data) || data.empty()) {
+        cout << "No code/sequence.txt, only pictures coded with the default VLC table are decoded." << endl;
+        return false;
+    }
+    istringstream ifs(string(data.begin(), data.end()));
+    vector<HuffmanEntry> entries;
+    int id;
+    if (!readHuffmanTable(ifs, id, entries) || (id != DEFAULT_TABLE_ID && id != huffmanTableID(entries))) {
+        // no picture names a table this file can not give, so every picture is refused
+        cout << "Bad sequence VLC table in code/sequence.txt." << endl;
+        sequence_table_id = -1;
+        return false;
+    }
+    sequence_table_id = id;
+    if (id == DEFAULT_TABLE_ID)
+        return true;
+
+    // same form as the default dict, the lookup table is rebuilt from it
+    decode_dict.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+        int symbol = entries[i].symbol;
+        if (symbol == ESCAPE_SYMBOL)
+            decode_dict[entries[i].code] = "ESCAPE";
+        else
+            decode_dict[entries[i].code] = bitset<6>(symbol >> 8).to_string() + "_" + bitset<8>(symbol & 255).to_string();
+    }
+    initVLCTable();
+    return true;
+}
@@ -3,7 +3,21 @@
 #include <bitset>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <mutex>
+#include <thread>
 #include <opencv2/opencv.hpp>
+#include "transform.h"
+#include "async_io.h"
+#include "scheduler.h"
+#include "geometry.h"
+#include "bitstream.h"
+#include "metrics.h"
+#include "huffman.h"
 
 using namespace std;
 using namespace cv;
@@ -13,273 +27,1229 @@ using namespace cv;
 #define INTRA true
 #define INTER false
 
+// bins of the luma histogram used by scene cut detection
+#define SCENE_HIST_BINS 32
+
+// largest motion vector component the 5 bit MV field can carry
+#define MAX_MV 15
+
+// MAD below which a cached motion vector only needs a one pixel refinement
+#define MV_CACHE_MAD_THRESHOLD 2.0
+
+// one pixel refinement steps around a motion vector scaled up from the half size simulcast layer
+#define SIMULCAST_REFINE_STEPS 2
+
+// two-pass mode: run-level pairs which occur less often go through ESCAPE,
+// the first pass leaves this mark in the code for every pair
+#define HUFFMAN_MIN_COUNT 2
+#define SYMBOL_MARK '*'
+
+// two-pass mode: stands for the table ID of the picture header until the table is known
+#define TABLE_MARK '#'
+
+// effort levels of the real-time mode, P frame rows step down when behind the deadline
+#define EFFORT_FULL 0       // full motion search
+#define EFFORT_REDUCED 1    // smaller search range
+#define EFFORT_PREDICTOR 2  // only evaluate the predictor candidates
+#define EFFORT_SKIP 3       // code every macroblock as zero vector without coefficients
+#define EFFORT_LEVELS 4
+
 int direction[9][2] = {
     {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, 0}
 };
 
+// motion vector of a macroblock relative to its search center
+struct MotionVector {
+    int h;  // horizontal, column direction
+    int v;  // vertical, row direction
+};
+
+// state used to decide the type of the next frame
+struct GOPState {
+    Mat last_hist;      // luma histogram of the last frame
+    Size last_size;     // size of the last frame
+    int gop_count;      // frames since the last I frame
+    int intra_count;
+    int scene_cut_count;
+};
+
 map<string, string> encode_dict;
 
+// encoder settings, can be changed from command line
+int gop_length = 16;                // force an I frame after this many frames, 0 means never
+double scene_cut_threshold = 0.4;   // histogram distance which starts a new GOP, 0 disables
+bool use_mv_cache = true;           // seed motion search with cached motion vectors
+bool report_psnr = false;           // rebuild every frame, measure its PSNR per plane and write frames.csv
+bool report_ssim = false;           // also measure SSIM, implies report_psnr
+double frame_deadline = 0;          // real-time mode: seconds per frame, 0 disables
+bool use_fixed_geometry = true;     // specialised pipelines for QCIF and CIF pictures
+bool simulcast = false;             // also code every picture at half size into code_half/
+bool dc_prediction = false;         // code intra DC terms as the difference to the left neighbour
+bool two_pass = false;              // code the run-level pairs with a table built for the whole sequence
+
+// multi-stream mode, every stream is a directory with its own img/ and code/
+vector<string> stream_dirs;
+vector<double> stream_priorities;   // share of the cores relative to the other streams
+int thread_count = 0;               // workers of the shared pool, 0 means one per core
+
+// asynchronous file access, shared by all streams
+int io_depth = 4;                   // frame reads and bitstream writes in flight
+bool use_io_uring = true;           // io_uring when the kernel supports it, worker threads otherwise
+AsyncIO* io = NULL;
+
+// serializes the messages of concurrently encoded streams
+mutex log_mutex;
+
+// statistics of one stream
+struct EncoderStats {
+    int frame_count;
+    long long macroblock_count;
+    long long code_bytes;
+    double encode_time;                         // seconds, without reading the pictures
+    int geometry_count[GEOMETRY_KINDS];         // pictures encoded on each pipeline
+    int skipped_count;                          // frames which were not rebuilt
+    long long effort_histogram[EFFORT_LEVELS];  // real-time mode
+    int missed_deadline_count;
+    long long mad_count;                        // motion search
+    long long searched_mb_count;
+    long long inter_block_count;                // early zero block detection
+    long long zero_block_count;
+    int intra_frame_count;
+    long long intra_code_bytes;
+    int quality_count;                          // pictures measured, Y, Cr, Cb and all planes
+    double psnr_sum[QUALITY_PLANES + 1];
+    double ssim_sum[QUALITY_PLANES + 1];
+    long long pair_count;                       // run-level pairs
+    long long escape_count;                     // pairs which are not in the VLC table
+};
+
+// a coded picture, held back until the second pass in two-pass mode
+struct CodedPicture {
+    int num;
+    bool frame_type;
+    double encode_time;
+    QualityStats quality;
+    string code;
+};
+
+/*
+    One encoder instance, it codes the pictures of <dir>img/ into <dir>code/.
+    All state which changes while encoding lives here, so several streams can
+    share the process. A picture is encoded in steps: one which loads it and sets
+    up the picture state, then one for every macroblock row.
+*/
+struct EncoderStream {
+    string dir;
+    string code_dir;            // <dir>code/, or <dir>code_half/ for a simulcast layer
+    string tag;                 // prefix of the messages, names the stream in multi-stream mode
+    ostringstream log;          // messages of the current step
+
+    // sequence state
+    int num;                    // next picture to encode
+    Mat cache_img;              // reconstruction of the last picture
+    vector<MotionVector> last_mv_field;
+    GOPState gop;
+    vector<int> read_tickets;
+    Mat next_img;               // decoded picture, frame types are decided one picture ahead
+    bool next_type;
+    bool next_scene_cut;
+    int effort_level;           // real-time effort, carried over to the next picture
+    bool failed;
+
+    // simulcast: the half size layer is fed with the converted pictures and codes the same frame types,
+    // a layer has no pictures of its own and its time is accounted to its full size stream
+    EncoderStream* half;
+    bool layer;
+    ofstream report;            // one line per picture with its size, time and quality
+
+    // two-pass: the run-level pairs of the held back pictures and their histogram
+    vector<CodedPicture> held_pictures;
+    vector<int> symbols;
+    vector<long long> histogram;
+
+    // state of the picture being encoded
+    Mat src_img;                // decoded picture
+    Mat YcrcbImg;               // converted stripe by stripe as the rows are encoded
+    int converted_rows;
+    Mat temp_cache_img;         // we can not modify cache frame when doing motion prediction, swapped in when done
+    bool extended_header;
+    bool frame_type;
+    bool reconstruct;
+    int geometry;               // pipeline of the picture size
+    int64 start_tick;
+    int mb_rows, mb_cols;
+    int mb_row;                 // next macroblock row, mb_rows when no picture is in progress
+    int mb_count;
+    ostringstream code;
+    vector<MotionVector> mv_field;
+    BlockBatch batch;
+    vector<float> block_quant;
+    vector<int> block_slot;
+    vector<string> row_mv;
+    QualityStats quality;
+
+    EncoderStats stats;
+    int64 begin_tick, end_tick;
+};
+
+void parseArguments(int argc, char* argv[]);
+
+string frameNumber(int num);
+
+void initStream(EncoderStream& s, const string& dir, bool named);
+
+void initLayer(EncoderStream& layer, const EncoderStream& s);
+
+void flushLog(EncoderStream& s);
+
+void openReport(EncoderStream& s, const string& filename);
+
+void reportQuality(EncoderStream& s, const CodedPicture& picture, const long long bits);
+
+void writePicture(EncoderStream& s, const CodedPicture& picture);
+
+void secondPass(EncoderStream& s);
+
+void writeSequenceHeader(EncoderStream& s, const int id, const vector<HuffmanEntry>& table);
+
+void printSummary(EncoderStream& s);
+
+void submitFrameRead(EncoderStream& s, int num);
+
 void InitEncodeDict();
 
+bool loadFrame(EncoderStream& s, int num, Mat& img);
+
+bool detectSceneCut(const Mat& img, Mat& last_hist);
+
+bool decideFrameType(EncoderStream& s, int num, const Mat& img, bool& scene_cut);
+
 void zigzagStep(int &x, int &y, bool &flag);
 
 bool checkCoeff(const Mat& src);
 
-void frameEncode(int num, Mat& cache_img, bool frame_type);
+bool encodeStep(EncoderStream& s);
+
+void runStream(FairSharePool& pool, int group, EncoderStream& s);
+
+bool beginFrame(EncoderStream& s);
+
+void setupPicture(EncoderStream& s, Size size);
+
+void convertRows(EncoderStream& s, int end);
+
+void encodeRow(EncoderStream& s);
+
+template<class Geometry>
+void encodeRow(EncoderStream& s, const Geometry& geo);
+
+void endFrame(EncoderStream& s);
+
+MotionVector scaleHalfVector(const MotionVector& mv, const int mb_row, const int mb_col);
+
+template<class Geometry>
+string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const int mb_row, const int mb_col,
+                          const vector<MotionVector>& last_mv_field, vector<MotionVector>& mv_field,
+                          const MotionVector* seed, const int effort, EncoderStats& stats, const Geometry& geo);
+
+template<class Geometry>
+void gatherMacroblock(const uchar* src, Mat& y, Mat& cr, Mat& cb, const Geometry& geo);
+
+template<class Geometry>
+double calMAD(const uchar* cur, const uchar* cache, const int center_x, const int center_y, const int ref_pos_x,
+              const int ref_pos_y, EncoderStats& stats, const Geometry& geo);
 
-string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const int mb_row, const int mb_col);
+template<class Geometry>
+double findMinimumMAD(const uchar* cur, const uchar* cache, const int center_x, const int center_y,
+                      int& target_x, int& target_y, const int offset, const double target_mad, EncoderStats& stats,
+                      const Geometry& geo);
 
-void findMinimumMAD(const Mat y, const Mat cache_img, int& target_x, int& target_y, const int offset);
+void encodeIntraDC(const int dc, const bool predicted, const int prediction, ostream& ofs);
 
-void fixedEncodeBlock(const Mat& src, ofstream& ofs);
+void encodeRunLevel(const int run, const int value, EncoderStream& s);
 
-void variableLengthEncodeBlock(const Mat& src, ofstream& ofs);
+void intraEncodeBlock(const Mat& src, const bool predicted, const int prediction, EncoderStream& s);
+
+void interEncodeBlock(const Mat& src, EncoderStream& s);
+
+int main(int argc, char* argv[]) {
+    // load encoder settings
+    parseArguments(argc, argv);
 
-int main(void) {
     // init vlc encode dict
     InitEncodeDict();
 
-    // init cache frame
-    Mat cache_img;
+    // start reading the first frames
+    io = createAsyncIO(io_depth, use_io_uring);
+    cout << "I/O backend: " << io->name() << endl;
 
-    // encode image sequence
-    for (int i = 1; i <= 113; i++) {
-        // every 4 frame, the first one is I frame
-        if (i % 4 == 1)
-            frameEncode(i, cache_img, INTRA);
-        else
-            frameEncode(i, cache_img, INTER);
+    // without streams the sequence in the current directory is encoded
+    bool multi_stream = !stream_dirs.empty();
+    if (!multi_stream) {
+        stream_dirs.push_back("");
+        stream_priorities.push_back(1);
     }
-    
-    return 0;
+    vector<EncoderStream*> streams;
+    for (size_t k = 0; k < stream_dirs.size(); k++) {
+        streams.push_back(new EncoderStream());
+        initStream(*streams[k], stream_dirs[k], multi_stream);
+    }
+
+    int64 start_tick = getTickCount();
+    int threads = 1;
+    double busy_time = 0;
+    if (!multi_stream) {
+        // encode image sequence
+        while (encodeStep(*streams[0]));
+    }
+    else {
+        // the pool provides all the parallelism, opencv must not start threads of its own
+        setNumThreads(0);
+        threads = thread_count > 0 ? thread_count : max(1, (int)thread::hardware_concurrency());
+        cout << "Encoding " << streams.size() << " streams on " << threads << " threads." << endl;
+
+        // every step of a stream queues the next one
+        FairSharePool pool(threads);
+        vector<int> groups;
+        for (size_t k = 0; k < streams.size(); k++) {
+            int group = pool.addGroup(stream_priorities[k]);
+            EncoderStream* s = streams[k];
+            pool.submit(group, [&pool, group, s]() { runStream(pool, group, *s); });
+            groups.push_back(group);
+        }
+        pool.wait();
+
+        for (size_t k = 0; k < groups.size(); k++)
+            busy_time += pool.busyTime(groups[k]);
+    }
+    double total_time = (getTickCount() - start_tick) / getTickFrequency();
+
+    // wait for the last code files
+    delete io;
+
+    int failed_count = 0;
+    int frame_count = 0;
+    long long macroblock_count = 0;
+    for (size_t k = 0; k < streams.size(); k++) {
+        EncoderStream& s = *streams[k];
+        if (s.failed)
+            failed_count++;
+        else {
+            printSummary(s);
+            if (s.half != NULL)
+                printSummary(*s.half);
+        }
+        frame_count += s.stats.frame_count;
+        macroblock_count += s.stats.macroblock_count;
+        if (s.half != NULL) {
+            frame_count += s.half->stats.frame_count;
+            macroblock_count += s.half->stats.macroblock_count;
+            delete s.half;
+        }
+        delete streams[k];
+    }
+
+    if (multi_stream) {
+        cout << "Total: " << frame_count << " frames in " << total_time << " s, "
+             << frame_count / total_time << " frames/s, " << macroblock_count / total_time << " macroblocks/s, "
+             << "thread utilization " << 100 * busy_time / (total_time * threads) << "%." << endl;
+        if (failed_count > 0)
+            cout << failed_count << " of " << streams.size() << " streams failed." << endl;
+    }
+
+    return failed_count > 0 ? 1 : 0;
 };
 
-void frameEncode(int num, Mat& cache_img, bool frame_type) {
-    cout << "***** Encoding picture " << num << ". *****" << endl;
+void parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gop") == 0 && i + 1 < argc)
+            gop_length = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scene-cut") == 0 && i + 1 < argc)
+            scene_cut_threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "--no-mv-cache") == 0)
+            use_mv_cache = false;
+        else if (strcmp(argv[i], "--psnr") == 0)
+            report_psnr = true;
+        else if (strcmp(argv[i], "--ssim") == 0)
+            report_psnr = report_ssim = true;
+        else if (strcmp(argv[i], "--realtime") == 0 && i + 1 < argc) {
+            // a zero or non-numeric rate would give an infinite deadline and still turn real-time mode on
+            double fps = atof(argv[++i]);
+            if (fps <= 0) {
+                cout << "--realtime needs a frame rate above 0, got " << argv[i] << "." << endl;
+                exit(1);
+            }
+            frame_deadline = 1.0 / fps;
+        }
+        else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc)
+            use_io_uring = strcmp(argv[++i], "threads") != 0;
+        else if (strcmp(argv[i], "--io-depth") == 0 && i + 1 < argc)
+            io_depth = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            // <dir>[:priority]
+            string spec = argv[++i];
+            size_t colon = spec.rfind(':');
+            double priority = 1;
+            if (colon != string::npos) {
+                priority = atof(spec.substr(colon + 1).c_str());
+                spec = spec.substr(0, colon);
+            }
+            stream_dirs.push_back(spec);
+            stream_priorities.push_back(priority > 0 ? priority : 1);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            thread_count = max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--generic-geometry") == 0)
+            use_fixed_geometry = false;
+        else if (strcmp(argv[i], "--simulcast") == 0)
+            simulcast = true;
+        else if (strcmp(argv[i], "--dc-prediction") == 0)
+            dc_prediction = true;
+        else if (strcmp(argv[i], "--two-pass") == 0)
+            two_pass = true;
+        else {
+            cout << "Usage: " << argv[0] << " [--gop length] [--scene-cut threshold] [--no-mv-cache] [--psnr] [--ssim]"
+                 << " [--realtime fps] [--io uring|threads] [--io-depth n]"
+                 << " [--stream dir[:priority]]... [--threads n] [--generic-geometry] [--simulcast] [--dc-prediction]"
+                 << " [--two-pass]" << endl;
+            exit(1);
+        }
+    }
+}
 
-    /*** load image ***/
-    // construct file name
+string frameNumber(int num) {
     stringstream ss;
     ss << num;
     string number = ss.str();
     while (number.length() < 4)
         number.insert(0, 1, '0');
-    string read_filename = "img/" + number + ".jpg";
+    return number;
+}
+
+void initStream(EncoderStream& s, const string& dir, bool named) {
+    s.dir = dir.empty() || dir[dir.size() - 1] == '/' ? dir : dir + "/";
+    s.code_dir = s.dir + "code/";
+    s.tag = named ? "[" + dir + "] " : "";
+    s.num = 1;
+    s.gop.gop_count = s.gop.intra_count = s.gop.scene_cut_count = 0;
+    s.effort_level = EFFORT_FULL;
+    s.failed = false;
+    s.half = NULL;
+    s.layer = false;
+    s.mb_rows = s.mb_row = 0;
+    memset(&s.stats, 0, sizeof(s.stats));
+
+    if (report_psnr)
+        openReport(s, s.dir + "frames.csv");
+    if (two_pass)
+        s.histogram.assign(RUN_LEVEL_SYMBOLS, 0);
+    else
+        writeSequenceHeader(s, DEFAULT_TABLE_ID, vector<HuffmanEntry>());
+
+    if (simulcast) {
+        s.half = new EncoderStream();
+        initLayer(*s.half, s);
+    }
+
+    // start reading the first frames
+    s.read_tickets.assign(113 + 1, -1);
+    for (int i = 1; i <= min(io_depth, 113); i++)
+        submitFrameRead(s, i);
+}
+
+void initLayer(EncoderStream& layer, const EncoderStream& s) {
+    // the layer reads no pictures, they come from the full size stream
+    layer.dir = s.dir;
+    layer.code_dir = s.dir + "code_half/";
+    layer.tag = s.tag + "[half size] ";
+    layer.num = 1;
+    layer.gop.gop_count = layer.gop.intra_count = layer.gop.scene_cut_count = 0;
+    layer.effort_level = EFFORT_FULL;
+    layer.failed = false;
+    layer.half = NULL;
+    layer.layer = true;
+    layer.mb_rows = layer.mb_row = 0;
+    memset(&layer.stats, 0, sizeof(layer.stats));
+    if (report_psnr)
+        openReport(layer, s.dir + "frames_half.csv");
+    if (two_pass)
+        layer.histogram.assign(RUN_LEVEL_SYMBOLS, 0);
+    else
+        writeSequenceHeader(layer, DEFAULT_TABLE_ID, vector<HuffmanEntry>());
+}
+
+void openReport(EncoderStream& s, const string& filename) {
+    s.report.open(filename.c_str(), ofstream::out);
+    s.report << "picture,type,bits,encode_ms,psnr_y,psnr_cr,psnr_cb,psnr";
+    if (report_ssim)
+        s.report << ",ssim_y,ssim_cr,ssim_cb,ssim";
+    s.report << endl;
+}
+
+void flushLog(EncoderStream& s) {
+    lock_guard<mutex> lock(log_mutex);
+    cout << s.log.str() << flush;
+    s.log.str("");
+}
+
+void printSummary(EncoderStream& s) {
+    const EncoderStats& stats = s.stats;
+    ostream& out = s.log;
+    out << s.tag << "I frames: " << s.gop.intra_count << ", P frames: " << 113 - s.gop.intra_count
+        << ", scene cuts: " << s.gop.scene_cut_count << endl;
+    out << s.tag << "Skipped reconstruction of " << stats.skipped_count << " unreferenced frames." << endl;
+    if (stats.searched_mb_count > 0)
+        out << s.tag << "Average MAD evaluations per macroblock: " << (double)stats.mad_count / stats.searched_mb_count
+            << " (motion vector cache " << (use_mv_cache ? "on" : "off") << ")" << endl;
+    if (stats.quality_count > 0) {
+        const double n = stats.quality_count;
+        out << s.tag << "Average PSNR: Y " << stats.psnr_sum[0] / n << ", Cr " << stats.psnr_sum[1] / n
+            << ", Cb " << stats.psnr_sum[2] / n << ", all " << stats.psnr_sum[QUALITY_PLANES] / n << " dB" << endl;
+        if (report_ssim)
+            out << s.tag << "Average SSIM: Y " << stats.ssim_sum[0] / n << ", Cr " << stats.ssim_sum[1] / n
+                << ", Cb " << stats.ssim_sum[2] / n << ", all " << stats.ssim_sum[QUALITY_PLANES] / n << endl;
+    }
+    if (stats.pair_count > 0)
+        out << s.tag << "Run-level pairs: " << stats.pair_count << ", ESCAPE: " << stats.escape_count << " ("
+            << 100.0 * stats.escape_count / stats.pair_count << "%) with the "
+            << (two_pass ? "sequence" : "default") << " VLC table" << endl;
+    if (stats.intra_frame_count > 0)
+        out << s.tag << "Average I frame code size: " << stats.intra_code_bytes / stats.intra_frame_count
+            << " bytes (DC prediction " << (dc_prediction ? "on" : "off") << ")" << endl;
+    if (stats.inter_block_count > 0)
+        out << s.tag << "Zero blocks detected early: " << stats.zero_block_count << " of " << stats.inter_block_count
+            << " inter blocks skipped the transforms." << endl;
+    if (frame_deadline > 0) {
+        out << s.tag << "Missed deadlines: " << stats.missed_deadline_count << " of 113 frames." << endl;
+        out << s.tag << "Effort histogram (P frame macroblocks): full " << stats.effort_histogram[EFFORT_FULL]
+            << ", reduced " << stats.effort_histogram[EFFORT_REDUCED]
+            << ", predictor " << stats.effort_histogram[EFFORT_PREDICTOR]
+            << ", skip " << stats.effort_histogram[EFFORT_SKIP] << endl;
+    }
+
+    if (stats.frame_count > 0) {
+        if (s.layer)
+            out << s.tag << "Pictures: " << stats.frame_count << " (";
+        else
+            out << s.tag << "Average encode time per picture" << (s.half != NULL ? " with the half size layer" : "") << ": "
+                << stats.encode_time * 1000 / stats.frame_count << " ms (";
+        for (int k = 0, first = 1; k < GEOMETRY_KINDS; k++) {
+            if (stats.geometry_count[k] == 0) continue;
+            out << (first ? "" : ", ") << geometryName(k) << " pipeline: " << stats.geometry_count[k];
+            first = 0;
+        }
+        out << " pictures)" << endl;
+    }
+
+    // a stream shares the cores, so its rate is measured from its first to its last picture
+    if (!s.tag.empty()) {
+        double time = (s.end_tick - s.begin_tick) / getTickFrequency();
+        out << s.tag << "Throughput: " << stats.frame_count / time << " frames/s, "
+            << stats.macroblock_count / time << " macroblocks/s, " << stats.code_bytes / 1024 << " KB of code." << endl;
+    }
+    flushLog(s);
+}
+
+void submitFrameRead(EncoderStream& s, int num) {
+    string read_filename = s.dir + "img/" + frameNumber(num) + ".jpg";
+    s.read_tickets[num] = io->submitRead(read_filename);
+}
+
+bool loadFrame(EncoderStream& s, int num, Mat& img) {
+    // wait for the prefetched file and keep the read queue full
+    vector<uchar> data;
+    bool read_ok = io->waitRead(s.read_tickets[num], data);
+    if (num + io_depth <= 113)
+        submitFrameRead(s, num + io_depth);
+    if (!read_ok)
+        return false;
+
+    // decode picture, its color space is converted stripe by stripe while encoding
+    img = imdecode(data, IMREAD_COLOR);
+    return !img.empty();
+}
+
+bool detectSceneCut(const Mat& img, Mat& last_hist) {
+    // work on a 1/8 scale luma plane, which is cheap and ignores noise
+    // scaling first only converts 1/64 of the picture
+    Mat small_img, small_luma;
+    resize(img, small_img, Size(max(1, img.cols / 8), max(1, img.rows / 8)), 0, 0, INTER_AREA);
+    cvtColor(small_img, small_img, COLOR_RGB2YCrCb);
+    extractChannel(small_img, small_luma, 0);
+
+    // build the normalized luma histogram
+    Mat hist = Mat::zeros(Size(1, SCENE_HIST_BINS), CV_32F);
+    for (int row = 0; row < small_luma.rows; row++) {
+        for (int col = 0; col < small_luma.cols; col++) {
+            hist.at<float_t>(small_luma.at<uchar>(row, col) * SCENE_HIST_BINS / 256, 0) += 1;
+        }
+    }
+    hist = hist / (double)small_luma.total();
+
+    // half of the L1 distance is the fraction of pixels which changed their bin
+    bool scene_cut = false;
+    if (!last_hist.empty() && scene_cut_threshold > 0)
+        scene_cut = norm(hist, last_hist, NORM_L1) / 2 > scene_cut_threshold;
+
+    hist.copyTo(last_hist);
+    return scene_cut;
+}
+
+bool decideFrameType(EncoderStream& s, int num, const Mat& img, bool& scene_cut) {
+    // start a new GOP on the first frame, on a scene cut or when the GOP is full
+    GOPState& gop = s.gop;
+    scene_cut = detectSceneCut(img, gop.last_hist);
+    bool frame_type = INTER;
+    if (gop.last_size != img.size())
+        frame_type = INTRA;
+    else if (scene_cut) {
+        s.log << s.tag << "Scene cut detected at picture " << num << "." << endl;
+        frame_type = INTRA;
+        gop.scene_cut_count++;
+    }
+    else if (gop_length > 0 && gop.gop_count >= gop_length)
+        frame_type = INTRA;
+    gop.last_size = img.size();
+
+    if (frame_type == INTRA) {
+        gop.gop_count = 0;
+        gop.intra_count++;
+    }
+    gop.gop_count++;
+    return frame_type;
+}
+
+bool encodeStep(EncoderStream& s) {
+    // start the next picture
+    if (s.mb_row == s.mb_rows) {
+        if (s.num > 113) {
+            // two-pass: code the held back pictures with the table of the whole sequence
+            if (two_pass && !s.held_pictures.empty())
+                secondPass(s);
+            return false;
+        }
+        if (!beginFrame(s)) {
+            s.failed = true;
+            flushLog(s);
+            return false;
+        }
+    }
+    // or encode its next macroblock row
+    else {
+        // convert the stripe of the row right before it is used, the last row also takes the rows below the grid
+        int end = s.mb_row == s.mb_rows - 1 ? s.YcrcbImg.rows : s.mb_row * 16 + 16;
+
+        // simulcast: a row of the half size layer runs ahead of the two full size rows it covers,
+        // its motion vectors seed their search
+        EncoderStream* half = s.half;
+        if (half != NULL && half->mb_row < half->mb_rows && half->mb_row * 2 <= s.mb_row) {
+            end = max(end, half->mb_row == half->mb_rows - 1 ? s.YcrcbImg.rows : half->mb_row * 32 + 32);
+            convertRows(s, end);
+            encodeRow(*half);
+        }
+        convertRows(s, end);
+        encodeRow(s);
+    }
+
+    if (s.mb_row == s.mb_rows)
+        endFrame(s);
+    return true;
+}
 
-    // read picture
-    Mat img = imread(read_filename);
-    const int img_cols = img.cols;
-    const int img_rows = img.rows;
+void runStream(FairSharePool& pool, int group, EncoderStream& s) {
+    // queue the next step behind the steps of the other streams; a row needs the one above it
+    // (motion vector seeds, the code order), so a stream has one step in flight and uses one core
+    if (encodeStep(s))
+        pool.submit(group, [&pool, group, &s]() { runStream(pool, group, s); });
+}
 
-    // convert color space
-    Mat YcrcbImg;
-    cvtColor(img, YcrcbImg, COLOR_RGB2YCrCb);
+bool beginFrame(EncoderStream& s) {
+    const int num = s.num;
+    if (num == 1) {
+        s.begin_tick = getTickCount();
+        if (!loadFrame(s, 1, s.next_img)) {
+            s.log << s.tag << "Can not read picture 1." << endl;
+            return false;
+        }
+        s.next_type = decideFrameType(s, 1, s.next_img, s.next_scene_cut);
+    }
+    s.src_img = s.next_img;
+    s.frame_type = s.next_type;
+    bool scene_cut = s.next_scene_cut;
+
+    // look ahead, only a following P frame references this one
+    bool referenced = false;
+    if (num < 113) {
+        s.next_img = Mat();
+        if (!loadFrame(s, num + 1, s.next_img)) {
+            s.log << s.tag << "Can not read picture " << num + 1 << "." << endl;
+            return false;
+        }
+        s.next_type = decideFrameType(s, num + 1, s.next_img, s.next_scene_cut);
+        referenced = s.next_type == INTER;
+    }
 
-    // init temporary frame cache
-    // because we can not modify cache frame when doing motion prediction
-    Mat temp_cache_img = Mat::zeros(img.size(), img.type());
-    cvtColor(temp_cache_img, temp_cache_img, CV_RGB2YCrCb);
+    // motion of the old scene says nothing about the new one
+    if (scene_cut)
+        s.last_mv_field.clear();
+
+    // reconstruction is also needed to measure the quality
+    s.reconstruct = referenced || report_psnr;
+    if (!s.reconstruct)
+        s.stats.skipped_count++;
+    setupPicture(s, s.src_img.size());
+
+    // simulcast: the half size layer codes the same picture as the same frame type
+    if (s.half != NULL) {
+        EncoderStream& half = *s.half;
+        if (num == 1)
+            half.begin_tick = s.begin_tick;
+        half.frame_type = s.frame_type;
+        half.reconstruct = s.reconstruct;
+        if (!half.reconstruct)
+            half.stats.skipped_count++;
+        if (scene_cut)
+            half.last_mv_field.clear();
+        half.gop.intra_count = s.gop.intra_count;
+        half.gop.scene_cut_count = s.gop.scene_cut_count;
+        setupPicture(half, Size(s.src_img.cols / 2, s.src_img.rows / 2));
+    }
+    return true;
+}
 
-    // init encode file
-    string output_filename = "code/" + number + ".txt";
-    ofstream ofs;
-    ofs.open(output_filename.c_str(), ofstream::out);
+void setupPicture(EncoderStream& s, Size size) {
+    const int num = s.num;
+    s.log << s.tag << "***** Encoding picture " << num << ". *****" << endl;
+    s.start_tick = getTickCount();
+
+    const int img_cols = size.width;
+    const int img_rows = size.height;
+    s.YcrcbImg.create(size, CV_8UC3);
+    s.converted_rows = 0;
+    resetQuality(s.quality);
+
+    // init temporary frame cache, it is reused until the picture size changes
+    // every macroblock is rebuilt, only the rows and columns outside the grid keep their initial value
+    if (s.reconstruct && s.temp_cache_img.size() != size) {
+        s.temp_cache_img = Mat::zeros(size, CV_8UC3);
+        cvtColor(s.temp_cache_img, s.temp_cache_img, CV_RGB2YCrCb);
+    }
+
+    // init encode buffer, it is written asynchronously when the picture is done
+    s.code.str("");
 
     // encode picture infomation
-    string PN = bitset<8>(num).to_string();
-    string PL = bitset<10>(img_cols).to_string();
-    string PW = bitset<10>(img_rows).to_string();
-    ofs << PN << endl << PL << endl << PW << endl;
+    s.extended_header = needsExtendedHeader(img_cols, img_rows);
+    string PN = bitset<PN_BITS>(num).to_string();
+    string PL = bitset<SIZE_BITS>(s.extended_header ? 0 : img_cols).to_string();
+    string PW = bitset<SIZE_BITS>(s.extended_header ? 0 : img_rows).to_string();
+    s.code << PN << endl << PL << endl << PW << endl;
+    if (s.extended_header)
+        s.code << bitset<EXT_SIZE_BITS>(img_cols) << endl << bitset<EXT_SIZE_BITS>(img_rows) << endl;
+
+    // the VLC table of the run-level pairs, in two-pass mode its ID is known after the last picture
+    if (two_pass)
+        s.code << TABLE_MARK << endl;
+    else
+        s.code << bitset<TABLE_ID_BITS>(DEFAULT_TABLE_ID) << endl;
 
     // calculate the macroblock infomation
-    const int mb_cols = img_cols / 16;
-    const int mb_rows = img_rows / 16;
-    int mb_count = 0;
-    
-    /*** encode every macro block ***/
-    for (int i = 0; i < mb_rows; i++) {
-        for (int j = 0; j < mb_cols; j++) {
-            // encode macroblock header
-            string MN = bitset<12>(mb_count).to_string();
-            string MTYPE = frame_type == INTRA ? "01" : "10";
-            string MQUANT = bitset<5>(16).to_string();
-            ofs << MN << endl << MTYPE << endl << MQUANT << endl;
-
-            // get macroblock data
-            Mat mb(YcrcbImg, Rect(j * 16, i * 16, 16, 16));
-            
-            // extract Y, Cr, Cb block
-            Mat y = Mat::zeros(Size(16, 16), CV_32F);
-            Mat cr = Mat::zeros(Size(8, 8), CV_32F);
-            Mat cb = Mat::zeros(Size(8, 8), CV_32F);
-            for (int row = 0; row < 16; row++) {
-                for (int col = 0; col < 16; col++) {
-                    // 4:1:1 subsampling
-                    y.at<float_t>(row, col) = mb.at<Vec3b>(row, col)[0];
-                    if (row % 2 == 1 && col % 2 == 0)
-                        cr.at<float_t>(row / 2, col / 2) = mb.at<Vec3b>(row, col)[1];
-                    if (row % 2 == 0 && col % 2 == 0)
-                        cb.at<float_t>(row / 2, col / 2) = mb.at<Vec3b>(row, col)[2];
-                }
-            }
+    s.geometry = geometryKind(img_cols, img_rows, use_fixed_geometry);
+    s.mb_cols = img_cols / 16;
+    s.mb_rows = img_rows / 16;
+    s.mb_row = 0;
+    s.mb_count = 0;
+
+    // motion vectors of this frame, the neighbours of a macroblock seed its search
+    MotionVector zero_mv = {0, 0};
+    s.mv_field.assign(s.mb_rows * s.mb_cols, zero_mv);
+    if (s.last_mv_field.size() != s.mv_field.size())
+        s.last_mv_field.clear();
+
+    // coefficient batch and quantizer step of every block in a macroblock row
+    // blocks which provably quantize to zero get no slot in the batch
+    initBlockBatch(s.batch, s.mb_cols * BLOCKS_PER_MB);
+    s.block_quant.assign(s.batch.stride, 16);
+    s.block_slot.resize(s.mb_cols * BLOCKS_PER_MB);
+    s.row_mv.resize(s.mb_cols);
+
+    flushLog(s);
+}
 
-            // motion prediction
-            string MV = frame_type == INTRA ? "0000000000" : motionCompensation(y, cr, cb, cache_img, i, j);
-            ofs << MV << endl;
-
-            // do DCT transform
-            Mat dct_y, dct_cr, dct_cb;
-            dct(y, dct_y);
-            dct(cr, dct_cr);
-            dct(cb, dct_cb);
-
-            // quantization
-            Mat quant_y = Mat::zeros(Size(16, 16), CV_32F);
-            Mat quant_cr = Mat::zeros(Size(8, 8), CV_32F);
-            Mat quant_cb = Mat::zeros(Size(8, 8), CV_32F);
-            for (int k = 0; k < 16; k++) {
-                for (int l = 0; l < 16; l++) {
-                    quant_y.at<float_t>(k, l) = round(dct_y.at<float_t>(k, l) / 16);
-                }
+void convertRows(EncoderStream& s, int end) {
+    const int begin = s.converted_rows;
+    if (end <= begin) return;
+    Mat stripe = s.YcrcbImg.rowRange(begin, end);
+    cvtColor(s.src_img.rowRange(begin, end), stripe, COLOR_RGB2YCrCb);
+    s.converted_rows = end;
+
+    // simulcast: scale the converted stripe down while it is in cache, stripes start on even rows
+    if (s.half != NULL && !s.half->YcrcbImg.empty()) {
+        Mat& half_img = s.half->YcrcbImg;
+        int half_end = min(end / 2, half_img.rows);
+        if (half_end > begin / 2) {
+            Mat half_stripe = half_img.rowRange(begin / 2, half_end);
+            resize(stripe.rowRange(0, (half_end - begin / 2) * 2), half_stripe, half_stripe.size(), 0, 0, INTER_AREA);
+        }
+    }
+}
+
+void encodeRow(EncoderStream& s) {
+    // the standard picture sizes run a copy with the macroblock grid as constants
+    if (s.geometry == GEOMETRY_QCIF)
+        encodeRow(s, QCIFGeometry());
+    else if (s.geometry == GEOMETRY_CIF)
+        encodeRow(s, CIFGeometry());
+    else
+        encodeRow(s, RuntimeGeometry(s.YcrcbImg.cols, s.YcrcbImg.rows));
+}
+
+template<class Geometry>
+void encodeRow(EncoderStream& s, const Geometry& geo) {
+    const int i = s.mb_row++;
+    const int mb_cols = geo.mb_cols;
+    const int mb_rows = geo.mb_rows;
+    const bool frame_type = s.frame_type;
+    const Mat& YcrcbImg = s.YcrcbImg;
+    const Mat& cache_img = s.cache_img;
+    BlockBatch& batch = s.batch;
+    const vector<float>& block_quant = s.block_quant;
+    vector<int>& block_slot = s.block_slot;
+    vector<string>& row_mv = s.row_mv;
+    EncoderStats& stats = s.stats;
+    ostringstream& ofs = s.code;
+
+    // real-time mode: compare the elapsed time with the deadline share of the rows done so far
+    int effort = EFFORT_FULL;
+    if (frame_deadline > 0 && frame_type == INTER) {
+        double elapsed = (getTickCount() - s.start_tick) / getTickFrequency();
+        double budget = frame_deadline * i / mb_rows;
+        if (i > 0 && elapsed > budget && s.effort_level < EFFORT_SKIP)
+            s.effort_level++;
+        else if (i > 0 && elapsed < budget * 0.75 && s.effort_level > EFFORT_FULL)
+            s.effort_level--;
+        effort = s.effort_level;
+
+        // only the P frame rows of real-time mode have an effort level to report
+        stats.effort_histogram[effort] += mb_cols;
+    }
+
+    /*** gather the prediction residual of the whole row ***/
+    batch.count = 0;
+    for (int j = 0; j < mb_cols; j++) {
+        // extract Y, Cr, Cb block of the macroblock
+        Mat y, cr, cb;
+        gatherMacroblock(YcrcbImg.ptr<uchar>() + i * 16 * geo.step + j * 16 * 3, y, cr, cb, geo);
+
+        // motion prediction, a skipped macroblock keeps the zero vector and codes no residual
+        if (frame_type == INTRA)
+            row_mv[j] = "0000000000";
+        else if (effort == EFFORT_SKIP)
+            row_mv[j] = "0000000000";
+        else {
+            // simulcast: start from the vector of the half size macroblock covering this one
+            const EncoderStream* half = s.half;
+            const MotionVector* seed = NULL;
+            MotionVector scaled;
+            if (half != NULL && i / 2 < half->mb_rows && j / 2 < half->mb_cols) {
+                scaled = scaleHalfVector(half->mv_field[(i / 2) * half->mb_cols + j / 2], i, j);
+                seed = &scaled;
             }
-            for (int k = 0; k < 8; k++) {
-                for (int l = 0; l < 8; l++) {
-                    quant_cr.at<float_t>(k, l) = round(dct_cr.at<float_t>(k, l) / 16);
-                    quant_cb.at<float_t>(k, l) = round(dct_cb.at<float_t>(k, l) / 16);
+            row_mv[j] = motionCompensation(y, cr, cb, cache_img, i, j, s.last_mv_field, s.mv_field, seed, effort, stats, geo);
+        }
+
+        // a residual block which can only quantize to zero skips the transforms
+        Mat blocks[BLOCKS_PER_MB];
+        splitMacroblock(y, cb, cr, blocks);
+        int* slot = &block_slot[j * BLOCKS_PER_MB];
+        for (int k = 0; k < BLOCKS_PER_MB; k++) {
+            if (frame_type == INTER) {
+                stats.inter_block_count++;
+                if (effort == EFFORT_SKIP || isZeroBlock(blocks[k], block_quant[0])) {
+                    stats.zero_block_count++;
+                    slot[k] = -1;
+                    continue;
                 }
             }
+            slot[k] = addBlock(batch);
+            loadBlock(batch, slot[k], blocks[k]);
+        }
+    }
 
-            // split quant_y
-            Mat quant_y_1(quant_y, Rect(0, 0, 8, 8));
-            Mat quant_y_2(quant_y, Rect(8, 0, 8, 8));
-            Mat quant_y_3(quant_y, Rect(0, 8, 8, 8));
-            Mat quant_y_4(quant_y, Rect(8, 8, 8, 8));
-
-            // check CBP
-            bool quant_y_1_flag = checkCoeff(quant_y_1);
-            bool quant_y_2_flag = checkCoeff(quant_y_2);
-            bool quant_y_3_flag = checkCoeff(quant_y_3);
-            bool quant_y_4_flag = checkCoeff(quant_y_4);
-            bool quant_cb_flag = checkCoeff(quant_cb);
-            bool quant_cr_flag = checkCoeff(quant_cr);
-            int cbp_count = 32 * quant_y_1_flag + 16 * quant_y_2_flag + 8 * quant_y_3_flag + 
-                            4 * quant_y_4_flag + 2 * quant_cb_flag + 1 * quant_cr_flag;
-            string CBP = bitset<6>(cbp_count).to_string();
-            ofs << CBP << endl;
-
-            // vlc encode coefficient
-            if (quant_y_1_flag) {
-                if (frame_type) fixedEncodeBlock(quant_y_1, ofs);
-                else variableLengthEncodeBlock(quant_y_1, ofs);
-            }
-            if (quant_y_2_flag) {
-                if (frame_type) fixedEncodeBlock(quant_y_2, ofs);
-                else variableLengthEncodeBlock(quant_y_2, ofs);
-            }
-            if (quant_y_3_flag) {
-                if (frame_type) fixedEncodeBlock(quant_y_3, ofs);
-                else variableLengthEncodeBlock(quant_y_3, ofs);
-            }
-            if (quant_y_4_flag) {
-                if (frame_type) fixedEncodeBlock(quant_y_4, ofs);
-                else variableLengthEncodeBlock(quant_y_4, ofs);
+    // DCT transform and quantization of all blocks in the row
+    transformBatch(batch, batch, false);
+    quantizeBatch(batch, block_quant);
+
+    /*** entropy code every macroblock of the row ***/
+    // DC terms of the left macroblock, every row starts from the reset value
+    int left_dc[BLOCKS_PER_MB];
+    fill(left_dc, left_dc + BLOCKS_PER_MB, DC_PREDICTION_RESET);
+    const int mtype = frame_type == INTER ? MTYPE_INTER : dc_prediction ? MTYPE_INTRA_PRED : MTYPE_INTRA;
+
+    for (int j = 0; j < mb_cols; j++) {
+        // encode macroblock header
+        string MN = s.extended_header ? bitset<EXT_MN_BITS>(s.mb_count).to_string() : bitset<MN_BITS>(s.mb_count).to_string();
+        string MTYPE = bitset<2>(mtype).to_string();
+        string MQUANT = bitset<5>(16).to_string();
+        ofs << MN << endl << MTYPE << endl << MQUANT << endl;
+        ofs << row_mv[j] << endl;
+
+        // get Y1, Y2, Y3, Y4, Cb, Cr coefficients
+        Mat quant[BLOCKS_PER_MB];
+        bool quant_flag[BLOCKS_PER_MB];
+        int cbp_count = 0;
+        for (int k = 0; k < BLOCKS_PER_MB; k++) {
+            quant[k] = Mat::zeros(Size(8, 8), CV_32F);
+            int slot = block_slot[j * BLOCKS_PER_MB + k];
+            if (slot >= 0)
+                storeBlock(batch, slot, quant[k]);
+
+            // check CBP, a block without slot is known to be zero
+            quant_flag[k] = slot >= 0 && checkCoeff(quant[k]);
+            cbp_count = cbp_count * 2 + quant_flag[k];
+        }
+        string CBP = bitset<6>(cbp_count).to_string();
+        ofs << CBP << endl;
+
+        // vlc encode coefficient, a block which is not coded has a zero DC term
+        int dc[BLOCKS_PER_MB];
+        for (int k = 0; k < BLOCKS_PER_MB; k++) {
+            dc[k] = quant_flag[k] ? quant[k].at<float_t>(0, 0) : 0;
+            if (!quant_flag[k]) continue;
+            if (frame_type) intraEncodeBlock(quant[k], mtype == MTYPE_INTRA_PRED, dcPrediction(left_dc, dc, k), s);
+            else interEncodeBlock(quant[k], s);
+        }
+        if (frame_type == INTRA)
+            copy(dc, dc + BLOCKS_PER_MB, left_dc);
+
+        s.mb_count++;
+    }
+
+    /******************************
+        resconstruct for cache 
+    *******************************/
+    // a frame which is never referenced does not need to be rebuilt
+    if (!s.reconstruct) return;
+
+    // inverse quantization and inverse dct of the row
+    dequantizeBatch(batch, block_quant);
+    transformBatch(batch, batch, true);
+
+    for (int j = 0; j < mb_cols; j++) {
+        /*** motion compensation ***/
+        const uchar* ref = NULL;
+        if (frame_type == INTER) {
+            // extract motion vector
+            const string& MV = row_mv[j];
+            int mvh = bitset<5>(MV.substr(0, 5)).to_ulong();
+            int mvv = bitset<5>(MV.substr(5, 5)).to_ulong();
+            mvh = mvh > 16 ? mvh - 32 : mvh;
+            mvv = mvv > 16 ? mvv - 32 : mvv;
+
+            // get ref center
+            int ref_pos_x = (i * 16 + 16) / 2 + mvv;
+            int ref_pos_y = (j * 16 + 16) / 2 + mvh;
+            ref = cache_img.data + (ref_pos_x - 8) * geo.step + (ref_pos_y - 8) * 3;
+        }
+
+        // add residual and reference, saturate and assign to cache frame
+        reconstructMacroblock(batch, &block_slot[j * BLOCKS_PER_MB], ref, geo.step,
+                              s.temp_cache_img.data + i * 16 * geo.step + j * 16 * 3, geo.step);
+    }
+
+    // measure the quality of the rebuilt row while it and its source are in cache
+    if (report_psnr) {
+        const uchar* src = YcrcbImg.data + i * 16 * geo.step;
+        const uchar* rebuilt = s.temp_cache_img.data + i * 16 * geo.step;
+        if (report_ssim)
+            accumulateSSIM(src, geo.step, rebuilt, geo.step, mb_cols * 16, 16, s.quality);
+        else
+            accumulateSSE(src, geo.step, rebuilt, geo.step, mb_cols * 16, 16, s.quality);
+    }
+}
+
+void endFrame(EncoderStream& s) {
+    // all rows of the half size layer are done before the last full size row
+    if (s.half != NULL)
+        endFrame(*s.half);
+
+    s.stats.frame_count++;
+    s.stats.macroblock_count += s.mb_count;
+    s.stats.geometry_count[s.geometry]++;
+
+    // the new reconstruct image becomes the cache frame, the old one is rebuilt next time
+    if (s.reconstruct)
+        swap(s.cache_img, s.temp_cache_img);
+
+    // check the real-time deadline
+    double encode_time = (getTickCount() - s.start_tick) / getTickFrequency();
+    s.stats.encode_time += encode_time;
+    if (frame_deadline > 0 && !s.layer) {
+        if (encode_time > frame_deadline) {
+            s.log << s.tag << "Missed deadline: " << encode_time * 1000 << " ms, effort level " << s.effort_level << "." << endl;
+            s.stats.missed_deadline_count++;
+        }
+    }
+
+    // the code is written now, or in two-pass mode when the table of the sequence is known
+    CodedPicture picture;
+    picture.num = s.num;
+    picture.frame_type = s.frame_type;
+    picture.encode_time = encode_time;
+    picture.quality = s.quality;
+    picture.code = s.code.str();
+    if (two_pass)
+        s.held_pictures.push_back(picture);
+    else
+        writePicture(s, picture);
+
+    // keep the motion vector field for the next P frame
+    if (s.frame_type == INTER)
+        s.last_mv_field.swap(s.mv_field);
+
+    s.num++;
+    s.end_tick = getTickCount();
+    flushLog(s);
+}
+
+void writePicture(EncoderStream& s, const CodedPicture& picture) {
+    // queue the write of the code file
+    string output_filename = s.code_dir + frameNumber(picture.num) + ".txt";
+    const string& code = picture.code;
+    vector<uchar> code_data(code.begin(), code.end());
+    io->submitWrite(output_filename, code_data);
+    s.stats.code_bytes += code.size();
+    if (picture.frame_type == INTRA) {
+        s.stats.intra_frame_count++;
+        s.stats.intra_code_bytes += code.size();
+    }
+
+    // every character of the code is a bit, except the line breaks
+    if (report_psnr)
+        reportQuality(s, picture, code.size() - count(code.begin(), code.end(), '\n'));
+}
+
+void secondPass(EncoderStream& s) {
+    // a rare pair is cheaper through ESCAPE than with a table entry of its own, ESCAPE always gets a code
+    vector<long long> counts(s.histogram);
+    long long escapes = 0;
+    for (size_t k = 0; k < counts.size(); k++) {
+        if (counts[k] > 0 && counts[k] < HUFFMAN_MIN_COUNT) {
+            escapes += counts[k];
+            counts[k] = 0;
+        }
+    }
+    counts[ESCAPE_SYMBOL] = max(escapes, 1LL);
+    vector<HuffmanEntry> table = buildHuffmanTable(counts, HUFFMAN_MAX_LENGTH);
+    vector<string> codes(RUN_LEVEL_SYMBOLS);
+    for (size_t k = 0; k < table.size(); k++)
+        codes[table[k].symbol] = table[k].code;
+    const string& escape = codes[ESCAPE_SYMBOL];
+    const int id = huffmanTableID(table);
+    const string table_id = bitset<TABLE_ID_BITS>(id).to_string();
+
+    // the sequence header carries the table
+    writeSequenceHeader(s, id, table);
+    s.log << s.tag << "Sequence VLC table: " << table.size() << " codes, the longest "
+          << table.back().length << " bits." << endl;
+
+    // replace the marks of every picture by the codes of their pairs, in the order they were coded
+    size_t next = 0;
+    for (size_t i = 0; i < s.held_pictures.size(); i++) {
+        CodedPicture& picture = s.held_pictures[i];
+        string code;
+        code.reserve(picture.code.size() * 4);
+        for (size_t pos = 0; pos < picture.code.size(); pos++) {
+            if (picture.code[pos] == TABLE_MARK) {
+                code += table_id;
+                continue;
             }
-            if (quant_cb_flag) {
-                if (frame_type) fixedEncodeBlock(quant_cb, ofs);
-                else variableLengthEncodeBlock(quant_cb, ofs);
+            if (picture.code[pos] != SYMBOL_MARK) {
+                code += picture.code[pos];
+                continue;
             }
-            if (quant_cr_flag) {
-                if (frame_type) fixedEncodeBlock(quant_cr, ofs);
-                else variableLengthEncodeBlock(quant_cr, ofs);
+            int symbol = s.symbols[next++];
+            if (!codes[symbol].empty())
+                code += codes[symbol];
+            else {
+                code += escape + bitset<14>(symbol).to_string();
+                s.stats.escape_count++;
             }
+        }
+        picture.code.swap(code);
+        writePicture(s, picture);
+    }
+    s.held_pictures.clear();
+    s.symbols.clear();
+    flushLog(s);
 
-            /******************************
-                resconstruct for cache 
-            *******************************/
-            // inverse quantization
-            Mat i_dct_y, i_dct_cr, i_dct_cb;
-            i_dct_y = quant_y * 16;
-            i_dct_cr = quant_cr * 16;
-            i_dct_cb = quant_cb * 16;
-
-            // inverse dct
-            Mat i_y, i_cr, i_cb;
-            dct(i_dct_y, i_y, cv::DCT_INVERSE);
-            dct(i_dct_cr, i_cr, cv::DCT_INVERSE);
-            dct(i_dct_cb, i_cb, cv::DCT_INVERSE);
-
-            /*** motion compensation ***/
-            if (frame_type == INTER) {
-                // extract motion vector
-                int mvh = bitset<5>(MV.substr(0, 5)).to_ulong();
-                int mvv = bitset<5>(MV.substr(5, 5)).to_ulong();
-                mvh = mvh > 16 ? mvh - 32 : mvh;
-                mvv = mvv > 16 ? mvv - 32 : mvv;
-
-                // get ref center
-                int ref_pos_x = (i * 16 + 16) / 2 + mvv;
-                int ref_pos_y = (j * 16 + 16) / 2 + mvh;
-                Mat ref_mb(cache_img, Rect(ref_pos_y - 8, ref_pos_x - 8, 16, 16));
-
-                // extract three channel of ref mb
-                Mat ref_y = Mat::zeros(Size(16, 16), CV_32F);
-                Mat ref_cr = Mat::zeros(Size(8, 8), CV_32F);
-                Mat ref_cb = Mat::zeros(Size(8, 8), CV_32F);
-                for (int row = 0; row < 16; row++) {
-                    for (int col = 0; col < 16; col++) {
-                        // 4:1:1 subsampling
-                        ref_y.at<float_t>(row, col) = ref_mb.at<Vec3b>(row, col)[0];
-                        if (row % 2 == 1 && col % 2 == 0)
-                            ref_cr.at<float_t>(row / 2, col / 2) = ref_mb.at<Vec3b>(row, col)[1];
-                        if (row % 2 == 0 && col % 2 == 0)
-                            ref_cb.at<float_t>(row / 2, col / 2) = ref_mb.at<Vec3b>(row, col)[2];
-                    }
-                }
+    if (s.half != NULL)
+        secondPass(*s.half);
+}
 
-                // do the compensation
-                i_y = ref_y + i_y;
-                i_cr = ref_cr + i_cr;
-                i_cb = ref_cb + i_cb;
-            }
+void writeSequenceHeader(EncoderStream& s, const int id, const vector<HuffmanEntry>& table) {
+    // written in either mode, the decoder checks the ID of every picture against it
+    ostringstream header;
+    writeHuffmanTable(header, id, table);
+    string header_code = header.str();
+    vector<uchar> header_data(header_code.begin(), header_code.end());
+    io->submitWrite(s.code_dir + "sequence.txt", header_data);
+    s.stats.code_bytes += header_code.size();
+}
 
-            // assign to cache frame
-            Mat cache_mb(temp_cache_img, Rect(j * 16, i * 16, 16, 16));
-            for (int row = 0; row < 16; row++) {
-                for (int col = 0; col < 16; col++) {
-                    // 4:1:1 upsampling
-                    cache_mb.at<Vec3b>(row, col)[0] = i_y.at<float_t>(row, col);
-                    cache_mb.at<Vec3b>(row, col)[1] = i_cr.at<float_t>(row / 2, col / 2);
-                    cache_mb.at<Vec3b>(row, col)[2] = i_cb.at<float_t>(row / 2, col / 2);
-                }
-            }
+void reportQuality(EncoderStream& s, const CodedPicture& picture, const long long bits) {
+    // planes are measured over the macroblock grid, all planes have the same size there
+    const QualityStats& q = picture.quality;
+    double psnr[QUALITY_PLANES + 1], ssim[QUALITY_PLANES + 1];
+    double sse = 0;
+    ssim[QUALITY_PLANES] = 0;
+    for (int c = 0; c < QUALITY_PLANES; c++) {
+        psnr[c] = psnrFromSSE(q.sse[c], q.pixels);
+        ssim[c] = q.windows > 0 ? q.ssim[c] / q.windows : 1;
+        sse += q.sse[c];
+        ssim[QUALITY_PLANES] += ssim[c] / QUALITY_PLANES;
+    }
+    psnr[QUALITY_PLANES] = psnrFromSSE(sse, q.pixels * QUALITY_PLANES);
+
+    s.log << s.tag << "PSNR: Y " << psnr[0] << ", Cr " << psnr[1] << ", Cb " << psnr[2] << ", all " << psnr[3] << " dB";
+    if (report_ssim)
+        s.log << ", SSIM: Y " << ssim[0] << ", Cr " << ssim[1] << ", Cb " << ssim[2] << ", all " << ssim[3];
+    s.log << endl;
+
+    s.report << picture.num << "," << (picture.frame_type == INTRA ? "I" : "P") << "," << bits << ","
+             << picture.encode_time * 1000;
+    for (int c = 0; c <= QUALITY_PLANES; c++)
+        s.report << "," << psnr[c];
+    if (report_ssim) {
+        for (int c = 0; c <= QUALITY_PLANES; c++)
+            s.report << "," << ssim[c];
+    }
+    s.report << endl;
 
-            mb_count++;
-        }
+    s.stats.quality_count++;
+    for (int c = 0; c <= QUALITY_PLANES; c++) {
+        s.stats.psnr_sum[c] += psnr[c];
+        s.stats.ssim_sum[c] += ssim[c];
     }
+}
+
+MotionVector scaleHalfVector(const MotionVector& mv, const int mb_row, const int mb_col) {
+    // reference block of the covering half size macroblock, top left corner in its pixels
+    int ref_x = (mb_row / 2 * 16 + 16) / 2 + mv.v - 8;
+    int ref_y = (mb_col / 2 * 16 + 16) / 2 + mv.h - 8;
 
-    // close output file
-    ofs.close();
+    // the same area at full size, moved to the quarter of this macroblock
+    ref_x = ref_x * 2 + mb_row % 2 * 16;
+    ref_y = ref_y * 2 + mb_col % 2 * 16;
 
-    // save the new reconstruct image to cache frame in YCrCb
-    temp_cache_img.copyTo(cache_img);
+    // relative to the search center of this macroblock
+    MotionVector scaled = {ref_y + 8 - (mb_col * 16 + 16) / 2, ref_x + 8 - (mb_row * 16 + 16) / 2};
+    return scaled;
 }
 
-string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const int mb_row, const int mb_col) {
+template<class Geometry>
+string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const int mb_row, const int mb_col,
+                          const vector<MotionVector>& last_mv_field, vector<MotionVector>& mv_field,
+                          const MotionVector* seed, const int effort, EncoderStats& stats, const Geometry& geo) {
     /*** find motion vector ***/
     // init useful variable
     int center_x = (mb_row * 16 + 16) / 2;
     int center_y = (mb_col * 16 + 16) / 2;
     int temp_x = center_x, temp_y = center_y;
-    int offset = 15 / 2;
-    bool last = false;
+    const int mb_cols = geo.mb_cols;
+    const int mb_index = mb_row * mb_cols + mb_col;
+    stats.searched_mb_count++;
+
+    // the search compares 8 bit luma, the cache frame is read in place
+    uchar cur[16 * 16];
+    const float* y_data = y.ptr<float>();
+    for (int k = 0; k < 16 * 16; k++)
+        cur[k] = (uchar)y_data[k];
+    const uchar* cache = cache_img.ptr<uchar>();
+
+    if (seed != NULL) {
+        // the vector of the half size layer is within one of its pixels, so a narrow refinement is enough
+        // the zero vector stays the fallback when the scaled vector can not be coded
+        double min_mad = calMAD(cur, cache, center_x, center_y, center_x, center_y, stats, geo);
+        if (seed->h != 0 || seed->v != 0) {
+            double seed_mad = calMAD(cur, cache, center_x, center_y, center_x + seed->v, center_y + seed->h, stats, geo);
+            if (seed_mad < min_mad) {
+                min_mad = seed_mad;
+                temp_x = center_x + seed->v;
+                temp_y = center_y + seed->h;
+            }
+        }
 
-    // 2-D logarithmic search
-    while (!last) {
-        findMinimumMAD(y, cache_img, temp_x, temp_y, offset);
-        if (offset == 1) last = true;
-        offset /= 2;
+        int steps = effort == EFFORT_FULL ? SIMULCAST_REFINE_STEPS : effort == EFFORT_REDUCED ? 1 : 0;
+        for (int k = 0; k < steps; k++) {
+            int last_x = temp_x, last_y = temp_y;
+            min_mad = findMinimumMAD(cur, cache, center_x, center_y, temp_x, temp_y, 1, min_mad, stats, geo);
+            if (temp_x == last_x && temp_y == last_y) break;
+        }
+    }
+    // predictor-only effort always needs the candidates
+    else if (use_mv_cache || effort >= EFFORT_PREDICTOR) {
+        // candidates: zero vector, coded left, top and top right neighbours, same macroblock of the last P frame
+        vector<MotionVector> candidates;
+        MotionVector zero_mv = {0, 0};
+        candidates.push_back(zero_mv);
+        if (mb_col > 0)
+            candidates.push_back(mv_field[mb_index - 1]);
+        if (mb_row > 0)
+            candidates.push_back(mv_field[mb_index - mb_cols]);
+        if (mb_row > 0 && mb_col < mb_cols - 1)
+            candidates.push_back(mv_field[mb_index - mb_cols + 1]);
+        if (!last_mv_field.empty())
+            candidates.push_back(last_mv_field[mb_index]);
+
+        // start from the best candidate, skipping repeated ones
+        double min_mad = DBL_MAX;
+        for (size_t k = 0; k < candidates.size(); k++) {
+            bool repeated = false;
+            for (size_t l = 0; l < k; l++) {
+                if (candidates[l].h == candidates[k].h && candidates[l].v == candidates[k].v)
+                    repeated = true;
+            }
+            if (repeated) continue;
+
+            double mad = calMAD(cur, cache, center_x, center_y, center_x + candidates[k].v, center_y + candidates[k].h, stats, geo);
+            if (mad < min_mad) {
+                min_mad = mad;
+                temp_x = center_x + candidates[k].v;
+                temp_y = center_y + candidates[k].h;
+            }
+        }
+
+        // a good predictor only needs one pixel steps, otherwise take one coarse step first
+        if (effort == EFFORT_FULL && min_mad > MV_CACHE_MAD_THRESHOLD)
+            min_mad = findMinimumMAD(cur, cache, center_x, center_y, temp_x, temp_y, 3, min_mad, stats, geo);
+
+        // refine until the position stops moving, reduced effort takes a single step
+        int steps = effort == EFFORT_FULL ? MAX_MV : effort == EFFORT_REDUCED ? 1 : 0;
+        for (int k = 0; k < steps; k++) {
+            int last_x = temp_x, last_y = temp_y;
+            min_mad = findMinimumMAD(cur, cache, center_x, center_y, temp_x, temp_y, 1, min_mad, stats, geo);
+            if (temp_x == last_x && temp_y == last_y) break;
+        }
+    }
+    else {
+        // reduced effort skips the largest step
+        int offset = effort == EFFORT_FULL ? 15 / 2 : 3;
+        bool last = false;
+
+        // 2-D logarithmic search, kept as the original: every step evaluates its center again and last,
+        // so a neighbour with the same MAD wins the tie, the cached search reuses the center MAD instead
+        while (!last) {
+            findMinimumMAD(cur, cache, center_x, center_y, temp_x, temp_y, offset, -1, stats, geo);
+            if (offset == 1) last = true;
+            offset /= 2;
+        }
     }
 
+    // remember the vector for the following macroblocks and the next P frame
+    mv_field[mb_index].h = temp_y - center_y;
+    mv_field[mb_index].v = temp_x - center_x;
+
     /*** low efficiency sequence way ***/
     // int img_rows = cache_img.rows;
     // int img_cols = cache_img.cols;
@@ -322,20 +1292,8 @@ string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const i
     string mv = bitset<5>(temp_y - center_y).to_string() + bitset<5>(temp_x - center_x).to_string();
 
     // get three channels of the cache block
-    const Mat ref(cache_img, Rect(temp_y - 8, temp_x - 8, 16, 16));
-    Mat ref_y = Mat::zeros(Size(16, 16), CV_32F);
-    Mat ref_cr = Mat::zeros(Size(8, 8), CV_32F);
-    Mat ref_cb = Mat::zeros(Size(8, 8), CV_32F);
-    for (int row = 0; row < 16; row++) {
-        for (int col = 0; col < 16; col++) {
-            // 4:1:1 subsampling
-            ref_y.at<float_t>(row, col) = ref.at<Vec3b>(row, col)[0];
-            if (row % 2 == 1 && col % 2 == 0)
-                ref_cr.at<float_t>(row / 2, col / 2) = ref.at<Vec3b>(row, col)[1];
-            if (row % 2 == 0 && col % 2 == 0)
-                ref_cb.at<float_t>(row / 2, col / 2) = ref.at<Vec3b>(row, col)[2];
-        }
-    }
+    Mat ref_y, ref_cr, ref_cb;
+    gatherMacroblock(cache + (temp_x - 8) * geo.step + (temp_y - 8) * 3, ref_y, ref_cr, ref_cb, geo);
 
     // cal difference
     y = y - ref_y;
@@ -345,31 +1303,62 @@ string motionCompensation(Mat& y, Mat& cr, Mat& cb, const Mat cache_img, const i
     return mv;
 }
 
-void findMinimumMAD(const Mat y, const Mat cache_img, int& target_x, int& target_y, const int offset) {
-    // init useful variable
-    double min_mad = DBL_MAX;
+template<class Geometry>
+void gatherMacroblock(const uchar* src, Mat& y, Mat& cr, Mat& cb, const Geometry& geo) {
+    // every element is written, rows of the frame are geo.step bytes apart
+    y.create(16, 16, CV_32F);
+    cr.create(8, 8, CV_32F);
+    cb.create(8, 8, CV_32F);
+    float* y_data = y.ptr<float>();
+    for (int row = 0; row < 16; row++, src += geo.step) {
+        for (int col = 0; col < 16; col++)
+            y_data[row * 16 + col] = src[col * 3];
+
+        // 4:1:1 subsampling, Cb from the even rows and Cr from the odd rows, both from the even columns
+        float* chroma = (row % 2 == 0 ? cb : cr).ptr<float>(row / 2);
+        const int channel = row % 2 == 0 ? 2 : 1;
+        for (int col = 0; col < 8; col++)
+            chroma[col] = src[col * 6 + channel];
+    }
+}
+
+template<class Geometry>
+double calMAD(const uchar* cur, const uchar* cache, const int center_x, const int center_y, const int ref_pos_x,
+              const int ref_pos_y, EncoderStats& stats, const Geometry& geo) {
+    // check if the motion vector can be coded and the ref center is in range
+    if (abs(ref_pos_x - center_x) > MAX_MV || abs(ref_pos_y - center_y) > MAX_MV) return DBL_MAX;
+    if (ref_pos_x < 8 || ref_pos_x > geo.rows - 8 || ref_pos_y < 8 || ref_pos_y > geo.cols - 8) return DBL_MAX;
+    stats.mad_count++;
+
+    // luma of the ref block in place, the sums of absolute differences stay exact in int
+    const uchar* ref = cache + (ref_pos_x - 8) * geo.step + (ref_pos_y - 8) * 3;
+    int sad = 0;
+    for (int row = 0; row < 16; row++, ref += geo.step, cur += 16) {
+        for (int col = 0; col < 16; col++)
+            sad += abs(cur[col] - ref[col * 3]);
+    }
+    return sad / (16.0 * 16);
+}
+
+template<class Geometry>
+double findMinimumMAD(const uchar* cur, const uchar* cache, const int center_x, const int center_y,
+                      int& target_x, int& target_y, const int offset, const double target_mad, EncoderStats& stats,
+                      const Geometry& geo) {
+    // init useful variable, the MAD of the current target is reused when already known
+    double min_mad = target_mad >= 0 ? target_mad : DBL_MAX;
     int min_x = target_x, min_y = target_y;
-    int img_rows = cache_img.rows;
-    int img_cols = cache_img.cols;
 
     // cal 9 direction MAD
     for (int i = 0; i < 9; i++) {
+        // the center has been evaluated by the last step
+        if (i == 8 && target_mad >= 0) continue;
+
         // get the next direction
         int ref_pos_x = target_x + direction[i][0] * offset;
         int ref_pos_y = target_y + direction[i][1] * offset;
 
-        // check if the ref center is out of range
-        if (ref_pos_x < 8 || ref_pos_x > img_rows - 8 || ref_pos_y < 8 || ref_pos_y > img_cols - 8) continue;
-
-        // get the sub ref block and split the color channel
-        Mat ref(cache_img, Rect(ref_pos_y - 8, ref_pos_x - 8, 16, 16));
-        Mat ref_y_int, ref_y;
-        extractChannel(ref, ref_y_int, 0);
-        ref_y_int.convertTo(ref_y, CV_32F);
-
-        // cal the MAD and compare
-        Mat abs_diff = abs(y - ref_y);
-        double mad = sum(abs_diff)[0] / (16 * 16);
+        // compare with the minimum MAD
+        double mad = calMAD(cur, cache, center_x, center_y, ref_pos_x, ref_pos_y, stats, geo);
         if (mad < min_mad) {
             min_mad = mad;
             min_x = ref_pos_x;
@@ -380,23 +1369,71 @@ void findMinimumMAD(const Mat y, const Mat cache_img, int& target_x, int& target
     // save the min MAD position for the next search
     target_x = min_x;
     target_y = min_y;
+    return min_mad;
 }
 
-void fixedEncodeBlock(const Mat& src, ofstream& ofs) {
-    // init useful variable
+void encodeIntraDC(const int dc, const bool predicted, const int prediction, ostream& ofs) {
+    if (!predicted) {
+        ofs << bitset<8>(dc).to_string();
+        return;
+    }
+
+    // size category of the difference, then the difference in that many bits,
+    // a negative difference is stored as the one's complement of its magnitude
+    int diff = dc - prediction;
+    int size = 0;
+    for (int magnitude = abs(diff); magnitude > 0; magnitude >>= 1)
+        size++;
+    ofs << dc_size_code[size];
+    if (size > 0) {
+        int bits = diff >= 0 ? diff : diff + (1 << size) - 1;
+        ofs << bitset<16>(bits).to_string().substr(16 - size);
+    }
+}
+
+void encodeRunLevel(const int run, const int value, EncoderStream& s) {
+    s.stats.pair_count++;
+
+    // two-pass: the code is chosen when the whole sequence is known, leave a mark
+    if (two_pass) {
+        int symbol = runLevelSymbol(run, value);
+        s.symbols.push_back(symbol);
+        s.histogram[symbol]++;
+        s.code << SYMBOL_MARK;
+        return;
+    }
+
+    string s_run = bitset<6>(run).to_string();
+    string s_value = bitset<8>(value).to_string();
+
+    // check if needed using vlc encode, the dict is shared by all streams and only read
+    string run_value = s_run + "_" + s_value;
+    map<string, string>::const_iterator code = encode_dict.find(run_value);
+    if (code != encode_dict.end())
+        s.code << code->second;
+    else {
+        s.code << encode_dict.find("ESCAPE")->second << s_run << s_value;
+        s.stats.escape_count++;
+    }
+}
+
+void intraEncodeBlock(const Mat& src, const bool predicted, const int prediction, EncoderStream& s) {
+    // the DC term is always sent, in 8 bits or as the difference to its prediction
+    encodeIntraDC(src.at<float_t>(0, 0), predicted, prediction, s.code);
+
+    // init useful variable, the AC terms start after the DC term
     int x = 0, y = 0;
     int run = 0;
     bool flag = ASCEND;
+    zigzagStep(x, y, flag);
 
-    // search all 64 value in zigzag way
-    int t = 64;
+    // search the other 63 value in zigzag way
+    int t = 63;
     while (t--) {
-        // deal with run value
+        // deal with run value, the AC terms share the VLC table of the inter blocks
         int value = src.at<float_t>(x, y);
-        if (value != 0 || (x == 0 && y == 0)) {
-            string s_run = bitset<6>(run).to_string();
-            string s_value = bitset<8>(value).to_string();
-            ofs << s_run << s_value;
+        if (value != 0) {
+            encodeRunLevel(run, value, s);
             run = 0;
         }
         else
@@ -405,10 +1442,10 @@ void fixedEncodeBlock(const Mat& src, ofstream& ofs) {
         // update index in zigzag way
         zigzagStep(x, y, flag);
     }
-    ofs << endl;
+    s.code << endl;
 }
 
-void variableLengthEncodeBlock(const Mat& src, ofstream& ofs) {
+void interEncodeBlock(const Mat& src, EncoderStream& s) {
     // init useful variable
     int x = 0, y = 0;
     int run = 0;
@@ -420,15 +1457,7 @@ void variableLengthEncodeBlock(const Mat& src, ofstream& ofs) {
         // deal with run value
         int value = src.at<float_t>(x, y);
         if (value != 0) {
-            string s_run = bitset<6>(run).to_string();
-            string s_value = bitset<8>(value).to_string();
-
-            // check if needed using vlc encode
-            string run_value = s_run + "_" + s_value;
-            if (encode_dict.find(run_value) != encode_dict.end())
-                ofs << encode_dict[run_value];
-            else
-                ofs << encode_dict["ESCAPE"] << s_run << s_value;
+            encodeRunLevel(run, value, s);
             run = 0;
         }
         else
@@ -437,7 +1466,7 @@ void variableLengthEncodeBlock(const Mat& src, ofstream& ofs) {
         // update index in zigzag way
         zigzagStep(x, y, flag);
     }
-    ofs << endl;
+    s.code << endl;
 }
 
 void zigzagStep(int &x, int &y, bool &flag) {
@@ -0,0 +1,49 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+/*
+    Frame geometry for the macroblock loops. The standard H.261 picture formats
+    are compile-time constants, so the loops over the macroblock grid have fixed
+    trip counts and the search bounds fold into the comparisons; any other size
+    uses the runtime geometry. Both have the same members, so a frame pipeline
+    is written once as a template over the geometry.
+    Frames are continuous 8 bit 3 channel Mats, so a row is step = cols * 3 bytes.
+*/
+template<int COLS, int ROWS>
+struct FixedGeometry {
+    enum {
+        cols = COLS,
+        rows = ROWS,
+        mb_cols = COLS / 16,
+        mb_rows = ROWS / 16,
+        step = COLS * 3
+    };
+};
+
+typedef FixedGeometry<176, 144> QCIFGeometry;
+typedef FixedGeometry<352, 288> CIFGeometry;
+
+struct RuntimeGeometry {
+    int cols, rows;
+    int mb_cols, mb_rows;
+    int step;
+
+    RuntimeGeometry(int cols, int rows)
+        : cols(cols), rows(rows), mb_cols(cols / 16), mb_rows(rows / 16), step(cols * 3) {}
+};
+
+// which pipeline a frame size runs on
+enum { GEOMETRY_QCIF, GEOMETRY_CIF, GEOMETRY_GENERIC, GEOMETRY_KINDS };
+
+inline int geometryKind(int cols, int rows, bool allow_fixed) {
+    if (allow_fixed && cols == QCIFGeometry::cols && rows == QCIFGeometry::rows) return GEOMETRY_QCIF;
+    if (allow_fixed && cols == CIFGeometry::cols && rows == CIFGeometry::rows) return GEOMETRY_CIF;
+    return GEOMETRY_GENERIC;
+}
+
+inline const char* geometryName(int kind) {
+    static const char* names[GEOMETRY_KINDS] = {"QCIF", "CIF", "generic"};
+    return names[kind];
+}
+
+#endif
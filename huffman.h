@@ -0,0 +1,161 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <vector>
+#include <queue>
+#include <string>
+#include <bitset>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+
+// run-level pair as a table index, the 6 bit run and the 8 bit level of the ESCAPE form
+#define RUN_LEVEL_SYMBOLS (1 << 14)
+
+// a zero level never occurs, so this index stands for ESCAPE
+#define ESCAPE_SYMBOL 0
+
+// longest code of a transmitted table, the decoder looks codes up by this many bits
+#define HUFFMAN_MAX_LENGTH 14
+
+// every picture header names the table its pairs are coded with, zero is the default table
+#define TABLE_ID_BITS 16
+#define DEFAULT_TABLE_ID 0
+
+/*
+    Canonical Huffman table of the run-level pairs, sent once in the sequence header
+    of a two-pass sequence. Only the code length of every symbol is sent: the codes
+    follow from the lengths by counting up in the order of length and symbol.
+    Header lines: the table ID in TABLE_ID_BITS, the number of entries in 16 bits, then
+    one line per entry with the run in 6 bits, the level in 8 bits and the code length
+    in 5 bits. A sequence coded with the default table has a header with its ID and no
+    entries, so a table left behind by an earlier sequence is never picked up.
+*/
+struct HuffmanEntry {
+    int symbol;
+    int length;
+    std::string code;
+};
+
+inline int runLevelSymbol(int run, int level) {
+    return run << 8 | (level & 255);
+}
+
+inline bool entryOrder(const HuffmanEntry& a, const HuffmanEntry& b) {
+    return a.length != b.length ? a.length < b.length : a.symbol < b.symbol;
+}
+
+// sort the entries into canonical order and give every entry its code
+inline void assignCanonicalCodes(std::vector<HuffmanEntry>& entries) {
+    std::sort(entries.begin(), entries.end(), entryOrder);
+    unsigned int code = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i > 0)
+            code = (code + 1) << (entries[i].length - entries[i - 1].length);
+        entries[i].code = std::bitset<32>(code).to_string().substr(32 - entries[i].length);
+    }
+}
+
+// Huffman code of every symbol with a count, no code is longer than max_length
+inline std::vector<HuffmanEntry> buildHuffmanTable(const std::vector<long long>& counts, int max_length) {
+    // merge the two rarest nodes until one is left, a leaf ends up as deep as its code is long
+    typedef std::pair<long long, int> Node;
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node> > queue;
+    std::vector<int> parent;
+    std::vector<int> symbols;
+    for (size_t k = 0; k < counts.size(); k++) {
+        if (counts[k] == 0) continue;
+        queue.push(Node(counts[k], parent.size()));
+        parent.push_back(-1);
+        symbols.push_back(k);
+    }
+    const int leaves = symbols.size();
+    while (queue.size() > 1) {
+        Node a = queue.top();
+        queue.pop();
+        Node b = queue.top();
+        queue.pop();
+        parent[a.second] = parent[b.second] = parent.size();
+        queue.push(Node(a.first + b.first, parent.size()));
+        parent.push_back(-1);
+    }
+
+    // number of codes of every length, a single symbol still needs one bit
+    std::vector<int> bits(std::max(leaves, max_length) + 2, 0);
+    for (int k = 0; k < leaves; k++) {
+        int length = 0;
+        for (int node = k; parent[node] >= 0; node = parent[node])
+            length++;
+        bits[std::max(length, 1)]++;
+    }
+
+    // move codes up until none is too long, the way JPEG limits its tables: two codes of the longest length
+    // become one code one bit shorter and two codes one bit longer than the next shorter code with room
+    for (int i = bits.size() - 1; i > max_length; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // the most frequent symbols get the shortest codes
+    std::vector<HuffmanEntry> entries;
+    for (int k = 0; k < leaves; k++) {
+        HuffmanEntry entry = {symbols[k], 0, ""};
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [&counts](const HuffmanEntry& a, const HuffmanEntry& b) {
+        return counts[a.symbol] != counts[b.symbol] ? counts[a.symbol] > counts[b.symbol] : a.symbol < b.symbol;
+    });
+    for (int length = 1, k = 0; length <= max_length; length++) {
+        for (int n = 0; n < bits[length]; n++)
+            entries[k++].length = length;
+    }
+    assignCanonicalCodes(entries);
+    return entries;
+}
+
+// a checksum of the lengths, a table with other codes gets another ID and never the default one
+inline int huffmanTableID(const std::vector<HuffmanEntry>& entries) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < entries.size(); i++) {
+        hash = (hash ^ entries[i].symbol) * 16777619u;
+        hash = (hash ^ entries[i].length) * 16777619u;
+    }
+    int id = (hash ^ hash >> TABLE_ID_BITS) & ((1 << TABLE_ID_BITS) - 1);
+    return id == DEFAULT_TABLE_ID ? 1 : id;
+}
+
+inline void writeHuffmanTable(std::ostream& ofs, int id, const std::vector<HuffmanEntry>& entries) {
+    ofs << std::bitset<TABLE_ID_BITS>(id) << std::endl;
+    ofs << std::bitset<16>(entries.size()) << std::endl;
+    for (size_t i = 0; i < entries.size(); i++) {
+        ofs << std::bitset<6>(entries[i].symbol >> 8) << std::bitset<8>(entries[i].symbol & 255)
+            << std::bitset<5>(entries[i].length) << std::endl;
+    }
+}
+
+inline bool readHuffmanTable(std::istream& ifs, int& id, std::vector<HuffmanEntry>& entries) {
+    std::string line;
+    if (!(ifs >> line)) return false;
+    id = std::bitset<TABLE_ID_BITS>(line).to_ulong();
+    if (!(ifs >> line)) return false;
+    int count = std::bitset<16>(line).to_ulong();
+    entries.clear();
+    for (int i = 0; i < count; i++) {
+        if (!(ifs >> line) || line.length() != 19) return false;
+        HuffmanEntry entry;
+        entry.symbol = std::bitset<14>(line.substr(0, 14)).to_ulong();
+        entry.length = std::bitset<5>(line.substr(14, 5)).to_ulong();
+        if (entry.length < 1 || entry.length > HUFFMAN_MAX_LENGTH) return false;
+        entries.push_back(entry);
+    }
+    assignCanonicalCodes(entries);
+    return true;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+// planes of an interleaved YCrCb picture
+#define QUALITY_PLANES 3
+
+// SSIM stabilizers (0.01 * 255)^2 and (0.03 * 255)^2
+#define SSIM_C1 6.5025
+#define SSIM_C2 58.5225
+
+// PSNR of a plane without any error
+#define PSNR_MAX 100.0
+
+/*
+    Quality of a rebuilt picture against its source, accumulated one macroblock row
+    at a time while both are in cache. PSNR comes from the sum of squared errors of
+    every plane. SSIM is the mean over non-overlapping 8x8 windows of every plane,
+    the window sums give the squared errors for free.
+*/
+struct QualityStats {
+    double sse[QUALITY_PLANES];     // Y, Cr, Cb
+    double ssim[QUALITY_PLANES];    // summed over the windows
+    long long pixels;               // per plane
+    long long windows;
+};
+
+inline void resetQuality(QualityStats& q) {
+    memset(&q, 0, sizeof(q));
+}
+
+inline double psnrFromSSE(double sse, long long pixels) {
+    if (sse <= 0 || pixels == 0) return PSNR_MAX;
+    return std::min(PSNR_MAX, 10 * std::log10(255.0 * 255.0 * pixels / sse));
+}
+
+inline double windowSSIM(double sa, double sb, double saa, double sbb, double sab) {
+    const double n = 64;
+    double mu_a = sa / n, mu_b = sb / n;
+    double var_a = saa / n - mu_a * mu_a;
+    double var_b = sbb / n - mu_b * mu_b;
+    double cov = sab / n - mu_a * mu_b;
+    return (2 * mu_a * mu_b + SSIM_C1) * (2 * cov + SSIM_C2) /
+           ((mu_a * mu_a + mu_b * mu_b + SSIM_C1) * (var_a + var_b + SSIM_C2));
+}
+
+// squared errors of the interleaved rows of a band, cols is a multiple of 16
+inline void accumulateSSE(const uchar* a, size_t a_step, const uchar* b, size_t b_step, int cols, int rows,
+                          QualityStats& q) {
+    for (int i = 0; i < rows; i++) {
+        const uchar* a_row = a + i * a_step;
+        const uchar* b_row = b + i * b_step;
+#if CV_SIMD128
+        // a lane adds at most 4 * 255^2 per 16 pixels, a row of 65535 pixels fits in int32
+        cv::v_int32x4 acc[QUALITY_PLANES];
+        for (int c = 0; c < QUALITY_PLANES; c++)
+            acc[c] = cv::v_setzero_s32();
+        for (int j = 0; j < cols; j += 16) {
+            cv::v_uint8x16 pa[QUALITY_PLANES], pb[QUALITY_PLANES];
+            cv::v_load_deinterleave(a_row + j * 3, pa[0], pa[1], pa[2]);
+            cv::v_load_deinterleave(b_row + j * 3, pb[0], pb[1], pb[2]);
+            for (int c = 0; c < QUALITY_PLANES; c++) {
+                cv::v_uint16x8 low, high;
+                cv::v_expand(cv::v_absdiff(pa[c], pb[c]), low, high);
+                cv::v_int16x8 d_low = cv::v_reinterpret_as_s16(low), d_high = cv::v_reinterpret_as_s16(high);
+                acc[c] = acc[c] + cv::v_dotprod(d_low, d_low) + cv::v_dotprod(d_high, d_high);
+            }
+        }
+        for (int c = 0; c < QUALITY_PLANES; c++)
+            q.sse[c] += cv::v_reduce_sum(acc[c]);
+#else
+        for (int j = 0; j < cols * 3; j++) {
+            int d = a_row[j] - b_row[j];
+            q.sse[j % 3] += d * d;
+        }
+#endif
+    }
+    q.pixels += (long long)cols * rows;
+}
+
+// SSIM and squared errors of the 8x8 windows of a band, cols is a multiple of 16 and rows of 8
+inline void accumulateSSIM(const uchar* a, size_t a_step, const uchar* b, size_t b_step, int cols, int rows,
+                           QualityStats& q) {
+    for (int i = 0; i < rows; i += 8) {
+        // two windows side by side for every 16 pixels
+        for (int j = 0; j < cols; j += 16) {
+            double sa[QUALITY_PLANES][2], sb[QUALITY_PLANES][2];
+            double saa[QUALITY_PLANES][2], sbb[QUALITY_PLANES][2], sab[QUALITY_PLANES][2];
+#if CV_SIMD128
+            // sums of 8 rows stay below 2^16, products are summed in int32
+            cv::v_uint16x8 acc_a[QUALITY_PLANES][2], acc_b[QUALITY_PLANES][2];
+            cv::v_int32x4 acc_aa[QUALITY_PLANES][2], acc_bb[QUALITY_PLANES][2], acc_ab[QUALITY_PLANES][2];
+            for (int c = 0; c < QUALITY_PLANES; c++) {
+                for (int h = 0; h < 2; h++) {
+                    acc_a[c][h] = acc_b[c][h] = cv::v_setzero_u16();
+                    acc_aa[c][h] = acc_bb[c][h] = acc_ab[c][h] = cv::v_setzero_s32();
+                }
+            }
+            for (int r = 0; r < 8; r++) {
+                cv::v_uint8x16 pa[QUALITY_PLANES], pb[QUALITY_PLANES];
+                cv::v_load_deinterleave(a + (i + r) * a_step + j * 3, pa[0], pa[1], pa[2]);
+                cv::v_load_deinterleave(b + (i + r) * b_step + j * 3, pb[0], pb[1], pb[2]);
+                for (int c = 0; c < QUALITY_PLANES; c++) {
+                    cv::v_uint16x8 wa[2], wb[2];
+                    cv::v_expand(pa[c], wa[0], wa[1]);
+                    cv::v_expand(pb[c], wb[0], wb[1]);
+                    for (int h = 0; h < 2; h++) {
+                        cv::v_int16x8 va = cv::v_reinterpret_as_s16(wa[h]), vb = cv::v_reinterpret_as_s16(wb[h]);
+                        acc_a[c][h] = acc_a[c][h] + wa[h];
+                        acc_b[c][h] = acc_b[c][h] + wb[h];
+                        acc_aa[c][h] = acc_aa[c][h] + cv::v_dotprod(va, va);
+                        acc_bb[c][h] = acc_bb[c][h] + cv::v_dotprod(vb, vb);
+                        acc_ab[c][h] = acc_ab[c][h] + cv::v_dotprod(va, vb);
+                    }
+                }
+            }
+            for (int c = 0; c < QUALITY_PLANES; c++) {
+                for (int h = 0; h < 2; h++) {
+                    cv::v_uint32x4 low, high;
+                    cv::v_expand(acc_a[c][h], low, high);
+                    sa[c][h] = cv::v_reduce_sum(low + high);
+                    cv::v_expand(acc_b[c][h], low, high);
+                    sb[c][h] = cv::v_reduce_sum(low + high);
+                    saa[c][h] = cv::v_reduce_sum(acc_aa[c][h]);
+                    sbb[c][h] = cv::v_reduce_sum(acc_bb[c][h]);
+                    sab[c][h] = cv::v_reduce_sum(acc_ab[c][h]);
+                }
+            }
+#else
+            memset(sa, 0, sizeof(sa));
+            memset(sb, 0, sizeof(sb));
+            memset(saa, 0, sizeof(saa));
+            memset(sbb, 0, sizeof(sbb));
+            memset(sab, 0, sizeof(sab));
+            for (int r = 0; r < 8; r++) {
+                const uchar* a_row = a + (i + r) * a_step + j * 3;
+                const uchar* b_row = b + (i + r) * b_step + j * 3;
+                for (int k = 0; k < 16 * 3; k++) {
+                    int c = k % 3, h = k / 24;
+                    sa[c][h] += a_row[k];
+                    sb[c][h] += b_row[k];
+                    saa[c][h] += a_row[k] * a_row[k];
+                    sbb[c][h] += b_row[k] * b_row[k];
+                    sab[c][h] += a_row[k] * b_row[k];
+                }
+            }
+#endif
+            for (int c = 0; c < QUALITY_PLANES; c++) {
+                for (int h = 0; h < 2; h++) {
+                    q.ssim[c] += windowSSIM(sa[c][h], sb[c][h], saa[c][h], sbb[c][h], sab[c][h]);
+                    q.sse[c] += saa[c][h] + sbb[c][h] - 2 * sab[c][h];
+                }
+            }
+            q.windows += 2;
+        }
+    }
+    q.pixels += (long long)cols * rows;
+}
+
+#endif
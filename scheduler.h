@@ -0,0 +1,167 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+/*
+    Thread pool shared by several independent task groups.
+    Each group has a priority weight and a virtual time which advances by the
+    run time of its tasks divided by the weight. Every group has its own ready
+    queue under the pool lock, and a free worker always takes the next task of
+    the group with the smallest virtual time over all queues, so busy groups
+    share the cores in proportion to their weights and none of them starves.
+    A group which was idle starts level with the busy groups again instead of
+    owning the cores until its old virtual time catches up.
+    A group only gets as many cores as it has tasks queued: a chain of tasks
+    where every task queues the next one never runs on more than one core.
+*/
+class FairSharePool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit FairSharePool(int threads)
+        : queued(0), running(0), stop(false) {
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&FairSharePool::work, this));
+    }
+
+    ~FairSharePool() {
+        wait();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        task_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    // add a task group, returns its id for submit
+    int addGroup(double weight) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Group group;
+        group.weight = weight > 0 ? weight : 1;
+        group.virtual_time = 0;
+        group.busy_time = 0;
+        group.task_count = 0;
+        group.active = 0;
+        groups.push_back(group);
+        return groups.size() - 1;
+    }
+
+    // queue a task behind the other tasks of its group
+    void submit(int group, const Task& task) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            Group& g = groups[group];
+            if (g.active == 0)
+                g.virtual_time = std::max(g.virtual_time, minActiveTime());
+            g.items.push_back(task);
+            g.active++;
+            queued++;
+        }
+        task_cv.notify_one();
+    }
+
+    // wait until every queued task and the tasks they submit have finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&]() { return queued == 0 && running == 0; });
+    }
+
+    int threadCount() const { return workers.size(); }
+
+    // seconds the tasks of a group have been running
+    double busyTime(int group) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return groups[group].busy_time;
+    }
+
+    long long taskCount(int group) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return groups[group].task_count;
+    }
+
+private:
+    struct Group {
+        double weight;
+        double virtual_time;
+        double busy_time;
+        long long task_count;
+        int active;                 // queued and running tasks
+        std::deque<Task> items;
+    };
+
+    // smallest virtual time of the groups with work, the pool lock is held
+    double minActiveTime() const {
+        double time = -1;
+        for (size_t i = 0; i < groups.size(); i++) {
+            if (groups[i].active > 0 && (time < 0 || groups[i].virtual_time < time))
+                time = groups[i].virtual_time;
+        }
+        return std::max(time, 0.0);
+    }
+
+    // take the next task of the group furthest behind, the pool lock is held
+    bool take(Task& task, int& group) {
+        group = -1;
+        for (size_t i = 0; i < groups.size(); i++) {
+            const Group& g = groups[i];
+            if (g.items.empty()) continue;
+            if (group < 0 || g.virtual_time < groups[group].virtual_time)
+                group = i;
+        }
+        if (group < 0) return false;
+
+        task = groups[group].items.front();
+        groups[group].items.pop_front();
+        queued--;
+        running++;
+        return true;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            Task task;
+            int group;
+            if (!take(task, group)) {
+                if (stop) return;
+                task_cv.wait(lock, [&]() { return stop || queued > 0; });
+                continue;
+            }
+
+            lock.unlock();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            task();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            lock.lock();
+
+            Group& g = groups[group];
+            g.virtual_time += elapsed / g.weight;
+            g.busy_time += elapsed;
+            g.task_count++;
+            g.active--;
+            running--;
+            if (queued == 0 && running == 0)
+                done_cv.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<Group> groups;
+    std::mutex mutex;
+    std::condition_variable task_cv, done_cv;
+    int queued;
+    int running;
+    bool stop;
+};
+
+#endif
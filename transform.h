@@ -0,0 +1,222 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+// Y1, Y2, Y3, Y4, Cb, Cr
+#define BLOCKS_PER_MB 6
+
+/*
+    Coefficient buffer of a whole macroblock row in structure of arrays layout.
+    Coefficient k of block b is stored at data[k * stride + b], so every kernel
+    below runs its inner loop over all blocks of the row with unit stride.
+    Only the first count slots are transformed, blocks which are known to have
+    no coefficients are not given a slot at all.
+*/
+struct BlockBatch {
+    int count;
+    int stride;
+    std::vector<float> data;
+    std::vector<float> scratch;
+
+    float* coeff(int k) { return &data[k * stride]; }
+    const float* coeff(int k) const { return &data[k * stride]; }
+};
+
+// 8 point DCT-II basis, scaled like cv::dct so the coefficients do not change
+struct DCTBasis {
+    float c[8][8];
+
+    DCTBasis() {
+        for (int u = 0; u < 8; u++) {
+            double scale = u == 0 ? std::sqrt(1.0 / 8) : std::sqrt(2.0 / 8);
+            for (int x = 0; x < 8; x++)
+                c[u][x] = scale * std::cos((2 * x + 1) * u * CV_PI / 16);
+        }
+    }
+};
+
+inline const DCTBasis& dctBasis() {
+    static const DCTBasis basis;
+    return basis;
+}
+
+inline void initBlockBatch(BlockBatch& batch, int capacity) {
+    batch.count = 0;
+    batch.stride = capacity;
+    batch.data.assign(64 * capacity, 0);
+    batch.scratch.resize(64 * capacity);
+}
+
+// take the next free slot of the batch
+inline int addBlock(BlockBatch& batch) {
+    return batch.count++;
+}
+
+// copy an 8x8 float block in or out of the batch
+inline void loadBlock(BlockBatch& batch, int b, const cv::Mat& block) {
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++)
+            batch.coeff(i * 8 + j)[b] = block.at<float>(i, j);
+    }
+}
+
+inline void storeBlock(const BlockBatch& batch, int b, cv::Mat& block) {
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++)
+            block.at<float>(i, j) = batch.coeff(i * 8 + j)[b];
+    }
+}
+
+// split a 16x16 luma block and two 8x8 chroma blocks into the 6 blocks of a macroblock
+inline void splitMacroblock(const cv::Mat& y, const cv::Mat& cb, const cv::Mat& cr, cv::Mat blocks[BLOCKS_PER_MB]) {
+    blocks[0] = y(cv::Rect(0, 0, 8, 8));
+    blocks[1] = y(cv::Rect(8, 0, 8, 8));
+    blocks[2] = y(cv::Rect(0, 8, 8, 8));
+    blocks[3] = y(cv::Rect(8, 8, 8, 8));
+    blocks[4] = cb;
+    blocks[5] = cr;
+}
+
+/*
+    Early zero block detection. Every product of two DCT basis functions is at most
+    cos(pi/16)^2 / 4 in magnitude, so no coefficient exceeds that times the SAD of the
+    residual, and by Parseval none exceeds the square root of its energy either.
+    If the bound is below half the quantizer step, every coefficient rounds to zero.
+*/
+inline bool isZeroBlock(const cv::Mat& residual, float quant) {
+    static const float max_basis = 0.25f * std::cos(CV_PI / 16) * std::cos(CV_PI / 16);
+
+    float sad = 0, energy = 0;
+    for (int i = 0; i < 8; i++) {
+        const float* row = residual.ptr<float>(i);
+        for (int j = 0; j < 8; j++) {
+            sad += std::fabs(row[j]);
+            energy += row[j] * row[j];
+        }
+    }
+
+    // leave a little room for the rounding error of the float transform
+    const float limit = 0.5f * quant - 1e-3f;
+    return max_basis * sad < limit || energy < limit * limit;
+}
+
+// separable 8x8 DCT (or IDCT) of every block in the batch
+inline void transformBatch(const BlockBatch& src, BlockBatch& dst, bool inverse) {
+    const DCTBasis& basis = dctBasis();
+    const int n = src.count;
+    float* temp = &dst.scratch[0];
+
+    // transform along the rows of every block
+    for (int i = 0; i < 8; i++) {
+        for (int v = 0; v < 8; v++) {
+            float* out = temp + (i * 8 + v) * n;
+            for (int b = 0; b < n; b++) out[b] = 0;
+            for (int j = 0; j < 8; j++) {
+                const float w = inverse ? basis.c[j][v] : basis.c[v][j];
+                const float* in = src.coeff(i * 8 + j);
+                for (int b = 0; b < n; b++) out[b] += w * in[b];
+            }
+        }
+    }
+
+    // transform along the columns
+    for (int u = 0; u < 8; u++) {
+        for (int v = 0; v < 8; v++) {
+            float* out = dst.coeff(u * 8 + v);
+            for (int b = 0; b < n; b++) out[b] = 0;
+            for (int i = 0; i < 8; i++) {
+                const float w = inverse ? basis.c[i][u] : basis.c[u][i];
+                const float* in = temp + (i * 8 + v) * n;
+                for (int b = 0; b < n; b++) out[b] += w * in[b];
+            }
+        }
+    }
+}
+
+// quantization with one step size per block
+inline void quantizeBatch(BlockBatch& batch, const std::vector<float>& quant) {
+    const int n = batch.count;
+    for (int k = 0; k < 64; k++) {
+        float* c = batch.coeff(k);
+        for (int b = 0; b < n; b++) c[b] = std::round(c[b] / quant[b]);
+    }
+}
+
+inline void dequantizeBatch(BlockBatch& batch, const std::vector<float>& quant) {
+    const int n = batch.count;
+    for (int k = 0; k < 64; k++) {
+        float* c = batch.coeff(k);
+        for (int b = 0; b < n; b++) c[b] *= quant[b];
+    }
+}
+
+/*
+    Motion compensated reconstruction of a macroblock of an inverse transformed batch,
+    slot[k] is the batch slot of block k or negative if the block has no residual.
+    The residual is rounded to int16, added to the reference macroblock at ref (NULL for
+    intra), saturated and stored into the interleaved YCrCb destination at dst in one pass.
+    Chroma is predicted from the subsampled reference and upsampled 2x2 on store.
+*/
+inline void reconstructMacroblock(const BlockBatch& batch, const int slot[BLOCKS_PER_MB], const uchar* ref,
+                                  size_t ref_step, uchar* dst, size_t dst_step) {
+    // an intra macroblock is predicted from a zero row
+    static const uchar zero_row[16 * 3] = {0};
+    if (ref == NULL) {
+        ref = zero_row;
+        ref_step = 0;
+    }
+
+    // gather the int16 residual, Y1 Y2 on the top half, Y3 Y4 on the bottom half
+    short res_y[16][16];
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) {
+            const int b = slot[(i / 8) * 2 + j / 8];
+            res_y[i][j] = b < 0 ? 0 : cv::saturate_cast<short>(batch.coeff((i % 8) * 8 + j % 8)[b]);
+        }
+    }
+
+    // chroma is small, add and saturate it at 8x8 before upsampling
+    uchar out_cr[8][8], out_cb[8][8];
+    for (int i = 0; i < 8; i++) {
+        const uchar* ref_even = ref + (2 * i) * ref_step;
+        const uchar* ref_odd = ref + (2 * i + 1) * ref_step;
+        for (int j = 0; j < 8; j++) {
+            short res_cb = slot[4] < 0 ? 0 : cv::saturate_cast<short>(batch.coeff(i * 8 + j)[slot[4]]);
+            short res_cr = slot[5] < 0 ? 0 : cv::saturate_cast<short>(batch.coeff(i * 8 + j)[slot[5]]);
+            out_cb[i][j] = cv::saturate_cast<uchar>(ref_even[2 * j * 3 + 2] + res_cb);
+            out_cr[i][j] = cv::saturate_cast<uchar>(ref_odd[2 * j * 3 + 1] + res_cr);
+        }
+    }
+
+    for (int i = 0; i < 16; i++) {
+        const uchar* ref_row = ref + i * ref_step;
+        uchar* dst_row = dst + i * dst_step;
+#if CV_SIMD128
+        // deinterleave the reference row, add the luma residual and pack with saturation
+        cv::v_uint8x16 ref_y, ref_cr, ref_cb;
+        cv::v_load_deinterleave(ref_row, ref_y, ref_cr, ref_cb);
+        cv::v_uint16x8 ref_y_low, ref_y_high;
+        cv::v_expand(ref_y, ref_y_low, ref_y_high);
+        cv::v_uint8x16 y = cv::v_pack_u(cv::v_reinterpret_as_s16(ref_y_low) + cv::v_load(res_y[i]),
+                                        cv::v_reinterpret_as_s16(ref_y_high) + cv::v_load(res_y[i] + 8));
+
+        // duplicate every chroma sample and store all three channels interleaved
+        cv::v_uint8x16 cr, cb, unused;
+        cv::v_zip(cv::v_load_low(out_cr[i / 2]), cv::v_load_low(out_cr[i / 2]), cr, unused);
+        cv::v_zip(cv::v_load_low(out_cb[i / 2]), cv::v_load_low(out_cb[i / 2]), cb, unused);
+        cv::v_store_interleave(dst_row, y, cr, cb);
+#else
+        for (int j = 0; j < 16; j++) {
+            dst_row[j * 3 + 0] = cv::saturate_cast<uchar>(ref_row[j * 3] + res_y[i][j]);
+            dst_row[j * 3 + 1] = out_cr[i / 2][j / 2];
+            dst_row[j * 3 + 2] = out_cb[i / 2][j / 2];
+        }
+#endif
+    }
+}
+
+#endif